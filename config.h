@@ -37,6 +37,14 @@
  */
 #define ALLOWICONS false
 
+/*
+ * Hide windows on other workspaces by moving them off screen instead
+ * of unmapping them. Many programs redraw everything when mapped
+ * again, so this makes changing workspaces faster. Can also be set
+ * by calling mcwm with -p.
+ */
+#define PARKWINDOWS false
+
 /*
  * Start these programs when pressing MOUSEMODKEY and mouse buttons on
  * root window.
@@ -57,6 +65,12 @@
 /* Ditto for fixed windows. Use "-x colour". */
 #define FIXEDCOL "grey90"
 
+/*
+ * Default number of workspaces. Can be set from command line with
+ * "-w number", up to 64.
+ */
+#define WORKSPACES 10
+
 /* Default width of border window, in pixels. Used unless -b width. */
 #define BORDERWIDTH 1
 
@@ -0,0 +1,293 @@
+#ifdef BENCH
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "hash.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/* Number of slots in a new table. Must be a power of two. */
+#define HASH_MINSIZE 64
+#define HASH_MINSHIFT 26
+
+/*
+ * Return the slot where key would be stored if there were no
+ * collisions.
+ *
+ * X window IDs are a per-client resource base ORed with a small
+ * counter, so almost all the entropy is in a few bits. Fibonacci
+ * hashing spreads them over the whole table.
+ */
+static unsigned hashslot(const struct hash *hash, uint32_t key)
+{
+    return (uint32_t) (key * 2654435761u) >> hash->shift;
+}
+
+/*
+ * Reallocate hash with size slots and shift value shift, moving all
+ * stored items.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int hashresize(struct hash *hash, unsigned size, unsigned shift)
+{
+    struct hash new;
+    unsigned i;
+    unsigned slot;
+
+    new.size = size;
+    new.shift = shift;
+    new.stored = hash->stored;
+
+    if (NULL == (new.keys = calloc(size, sizeof (uint32_t))))
+    {
+        return -1;
+    }
+
+    if (NULL == (new.data = calloc(size, sizeof (void *))))
+    {
+        free(new.keys);
+        return -1;
+    }
+
+    for (i = 0; i < hash->size; i ++)
+    {
+        if (NULL == hash->data[i])
+        {
+            continue;
+        }
+
+        for (slot = hashslot(&new, hash->keys[i]); NULL != new.data[slot];
+             slot = (slot + 1) & (size - 1))
+            ;
+
+        new.keys[slot] = hash->keys[i];
+        new.data[slot] = hash->data[i];
+    }
+
+    free(hash->keys);
+    free(hash->data);
+
+    *hash = new;
+
+    return 0;
+}
+
+void *hashfind(struct hash *hash, uint32_t key)
+{
+    unsigned slot;
+
+    if (0 == hash->size)
+    {
+        return NULL;
+    }
+
+    for (slot = hashslot(hash, key); NULL != hash->data[slot];
+         slot = (slot + 1) & (hash->size - 1))
+    {
+        if (key == hash->keys[slot])
+        {
+            return hash->data[slot];
+        }
+    }
+
+    return NULL;
+}
+
+int hashadd(struct hash *hash, uint32_t key, void *data)
+{
+    unsigned slot;
+
+    /* Keep the table at most half full so probe chains stay short. */
+    if (0 == hash->size)
+    {
+        if (-1 == hashresize(hash, HASH_MINSIZE, HASH_MINSHIFT))
+        {
+            return -1;
+        }
+    }
+    else if ((hash->stored + 1) * 2 > hash->size)
+    {
+        if (-1 == hashresize(hash, hash->size * 2, hash->shift - 1))
+        {
+            return -1;
+        }
+    }
+
+    for (slot = hashslot(hash, key); NULL != hash->data[slot];
+         slot = (slot + 1) & (hash->size - 1))
+    {
+        if (key == hash->keys[slot])
+        {
+            /* Already here. Replace. */
+            hash->data[slot] = data;
+            return 0;
+        }
+    }
+
+    hash->keys[slot] = key;
+    hash->data[slot] = data;
+    hash->stored ++;
+
+    return 0;
+}
+
+void *hashdel(struct hash *hash, uint32_t key)
+{
+    unsigned mask;
+    unsigned slot;
+    unsigned next;
+    unsigned home;
+    void *data;
+
+    if (0 == hash->size)
+    {
+        return NULL;
+    }
+
+    mask = hash->size - 1;
+
+    for (slot = hashslot(hash, key); NULL != hash->data[slot];
+         slot = (slot + 1) & mask)
+    {
+        if (key == hash->keys[slot])
+        {
+            break;
+        }
+    }
+
+    if (NULL == hash->data[slot])
+    {
+        /* Not found. */
+        return NULL;
+    }
+
+    data = hash->data[slot];
+
+    /*
+     * We can't just empty the slot since that would break the probe
+     * chain of any item stored after us. Instead, walk the rest of
+     * the chain and move back every item that is allowed to live in
+     * the hole we're leaving.
+     */
+    for (next = (slot + 1) & mask; NULL != hash->data[next];
+         next = (next + 1) & mask)
+    {
+        home = hashslot(hash, hash->keys[next]);
+
+        /* Is home cyclically outside (slot, next]? Then move it. */
+        if ((slot < next && (home <= slot || home > next))
+            || (slot > next && home <= slot && home > next))
+        {
+            hash->keys[slot] = hash->keys[next];
+            hash->data[slot] = hash->data[next];
+            slot = next;
+        }
+    }
+
+    hash->data[slot] = NULL;
+    hash->stored --;
+
+    return data;
+}
+
+void hashfree(struct hash *hash)
+{
+    free(hash->keys);
+    free(hash->data);
+
+    hash->keys = NULL;
+    hash->data = NULL;
+    hash->size = 0;
+    hash->shift = 0;
+    hash->stored = 0;
+}
+
+#ifdef BENCH
+
+/*
+ * Compare window lookups through the hash with a linear scan of the
+ * kind findclient() used to do.
+ *
+ * cc -std=c99 -O2 -DBENCH hash.c -o hashbench
+ */
+
+#include <time.h>
+
+#define LOOKUPS 1000000
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+    static const unsigned counts[] = { 10, 100, 1000, 10000 };
+    struct hash hash = { 0 };
+    uint32_t *wins;
+    unsigned c;
+    unsigned i;
+    unsigned n;
+    double start;
+    double hashns;
+    double scanns;
+    volatile uintptr_t sink = 0;
+
+    printf("%8s %12s %12s\n", "windows", "hash ns", "scan ns");
+
+    for (c = 0; c < sizeof counts / sizeof counts[0]; c ++)
+    {
+        n = counts[c];
+
+        if (NULL == (wins = malloc(n * sizeof (uint32_t))))
+        {
+            perror("malloc");
+            exit(1);
+        }
+
+        /* Fake X clients: a resource base per client and a low ID. */
+        for (i = 0; i < n; i ++)
+        {
+            wins[i] = ((i + 1) << 18) | 0x0a;
+            hashadd(&hash, wins[i], &wins[i]);
+        }
+
+        start = now();
+        for (i = 0; i < LOOKUPS; i ++)
+        {
+            sink += (uintptr_t) hashfind(&hash, wins[(i * 7919) % n]);
+        }
+        hashns = (now() - start) / LOOKUPS;
+
+        start = now();
+        for (i = 0; i < LOOKUPS / 100; i ++)
+        {
+            uint32_t key = wins[(i * 7919) % n];
+            unsigned j;
+
+            for (j = 0; j < n && wins[j] != key; j ++)
+                ;
+            sink += j;
+        }
+        scanns = (now() - start) / (LOOKUPS / 100);
+
+        printf("%8u %12.1f %12.1f\n", n, hashns, scanns);
+
+        hashfree(&hash);
+        free(wins);
+    }
+
+    return 0;
+}
+
+#endif /* BENCH */
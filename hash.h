@@ -0,0 +1,45 @@
+#include <stdint.h>
+
+/*
+ * Hash table mapping 32-bit keys, such as X window IDs, to data
+ * pointers. Open addressing with linear probing.
+ *
+ * A zeroed struct hash is a valid, empty table. Memory is allocated
+ * when the first item is added.
+ */
+struct hash
+{
+    uint32_t *keys;
+    void **data;               /* NULL marks an empty slot. */
+    unsigned size;             /* Number of slots. Always a power of two. */
+    unsigned shift;            /* 32 - log2(size). */
+    unsigned stored;           /* Number of items in table. */
+};
+
+/*
+ * Find data stored under key in hash.
+ *
+ * Returns data or NULL if not found.
+ */
+void *hashfind(struct hash *hash, uint32_t key);
+
+/*
+ * Store data under key in hash, replacing anything already stored
+ * under key. data must not be NULL.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int hashadd(struct hash *hash, uint32_t key, void *data);
+
+/*
+ * Delete key from hash.
+ *
+ * Returns the data that was stored under key or NULL if not found.
+ */
+void *hashdel(struct hash *hash, uint32_t key);
+
+/*
+ * Free all memory used by hash and make it empty. Does not free the
+ * stored data.
+ */
+void hashfree(struct hash *hash);
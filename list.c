@@ -15,6 +15,112 @@
 #define D(x)
 #endif
 
+/* Alignment of pool objects. */
+union poolalign
+{
+    void *p;
+    long l;
+    double d;
+};
+
+#define POOL_ALIGN (sizeof (union poolalign))
+
+struct pool itempool = POOL_INIT(struct item);
+
+/*
+ * Return the size of objects in pool rounded up so they can hold a
+ * free list pointer and be stored back to back with proper alignment.
+ */
+static size_t poolobjsize(struct pool *pool)
+{
+    return (pool->size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+}
+
+/*
+ * Allocate another slab for pool and put all objects in it on the
+ * free list.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int poolgrow(struct pool *pool)
+{
+    size_t objsize = poolobjsize(pool);
+    size_t slabsize;
+    unsigned perslab;
+    unsigned i;
+    char *slab;
+    char *obj;
+
+    /* The first aligned word of every slab links to the next slab. */
+    perslab = (POOL_SLABSIZE - POOL_ALIGN) / objsize;
+    if (0 == perslab)
+    {
+        perslab = 1;
+    }
+    slabsize = POOL_ALIGN + perslab * objsize;
+
+    if (NULL == (slab = malloc(slabsize)))
+    {
+        return -1;
+    }
+
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+    pool->nslabs ++;
+
+    /* Link objects so the lowest address is handed out first. */
+    for (i = perslab; i > 0; i --)
+    {
+        obj = slab + POOL_ALIGN + (i - 1) * objsize;
+        *(void **) obj = pool->freelist;
+        pool->freelist = obj;
+    }
+
+    return 0;
+}
+
+void *poolget(struct pool *pool)
+{
+    void *obj;
+
+    if (NULL == pool->freelist && -1 == poolgrow(pool))
+    {
+        return NULL;
+    }
+
+    obj = pool->freelist;
+    pool->freelist = *(void **) obj;
+
+    pool->allocs ++;
+    pool->inuse ++;
+    if (pool->inuse > pool->peak)
+    {
+        pool->peak = pool->inuse;
+    }
+
+    return obj;
+}
+
+void poolput(struct pool *pool, void *obj)
+{
+    if (NULL == obj)
+    {
+        return;
+    }
+
+    *(void **) obj = pool->freelist;
+    pool->freelist = obj;
+    pool->inuse --;
+}
+
+void poolstats(struct pool *pool, const char *name)
+{
+    printf("pool %s: %lu bytes/object, %u slabs, %u in use, %u peak, "
+           "%lu allocations.\n",
+           name, (unsigned long) poolobjsize(pool), pool->nslabs,
+           pool->inuse, pool->peak, pool->allocs);
+}
+
 /*
  * Move element in item to the head of list mainlist.
  */
@@ -64,7 +170,7 @@ struct item *additem(struct item **mainlist)
 {
     struct item *item;
 
-    if (NULL == (item = (struct item *) malloc(sizeof (struct item))))
+    if (NULL == (item = poolget(&itempool)))
     {
         return NULL;
     }
@@ -115,7 +221,7 @@ void delitem(struct item **mainlist, struct item *item)
         }
     }
 
-    free(item);
+    poolput(&itempool, item);
 }
 
 void freeitem(struct item **list, int *stored,
@@ -1,3 +1,5 @@
+#include <stddef.h>
+
 struct item
 {
     void *data;
@@ -5,6 +7,174 @@ struct item
     struct item *next;
 };
 
+/*
+ * Intrusive doubly linked lists.
+ *
+ * The links live in the listed structure itself, so walking a list
+ * goes straight from one element to the next without a separate
+ * struct item in between. An element can be on several lists at
+ * once by having one link field per list.
+ *
+ * ILIST_HEAD(name, type) declares struct name, the head of a list of
+ * struct type. A zeroed head is an empty list. ILIST_LINK(type)
+ * declares a link field inside struct type.
+ *
+ * All operations are O(1) except walking. Arguments may be evaluated
+ * more than once, so don't pass expressions with side effects or
+ * expressions that depend on the list being changed.
+ */
+#define ILIST_HEAD(name, type)                                          \
+    struct name                                                         \
+    {                                                                   \
+        struct type *first;                                             \
+        struct type *last;                                              \
+        unsigned len;                                                   \
+    }
+
+#define ILIST_LINK(type)                                                \
+    struct                                                              \
+    {                                                                   \
+        struct type *prev;                                              \
+        struct type *next;                                              \
+    }
+
+#define ILIST_INIT(head)                                                \
+    do {                                                                \
+        (head)->first = NULL;                                           \
+        (head)->last = NULL;                                            \
+        (head)->len = 0;                                                \
+    } while (0)
+
+#define ILIST_FIRST(head) ((head)->first)
+#define ILIST_LAST(head) ((head)->last)
+#define ILIST_LEN(head) ((head)->len)
+#define ILIST_EMPTY(head) (NULL == (head)->first)
+#define ILIST_NEXT(elm, field) ((elm)->field.next)
+#define ILIST_PREV(elm, field) ((elm)->field.prev)
+
+/* Is elm on list head? field must be cleared when elm isn't linked. */
+#define ILIST_LINKED(head, elm, field)                                  \
+    (NULL != (elm)->field.prev || (head)->first == (elm))
+
+#define ILIST_FOREACH(var, head, field)                                 \
+    for ((var) = (head)->first; NULL != (var); (var) = (var)->field.next)
+
+/* Walk list, allowing removal of var. tmp holds the next element. */
+#define ILIST_FOREACH_SAFE(var, head, field, tmp)                       \
+    for ((var) = (head)->first;                                         \
+         NULL != (var) && ((tmp) = (var)->field.next, 1);               \
+         (var) = (tmp))
+
+#define ILIST_INSERT_HEAD(head, elm, field)                             \
+    do {                                                                \
+        (elm)->field.prev = NULL;                                       \
+        (elm)->field.next = (head)->first;                              \
+        if (NULL != (head)->first)                                      \
+        {                                                               \
+            (head)->first->field.prev = (elm);                          \
+        }                                                               \
+        else                                                            \
+        {                                                               \
+            (head)->last = (elm);                                       \
+        }                                                               \
+        (head)->first = (elm);                                          \
+        (head)->len ++;                                                 \
+    } while (0)
+
+#define ILIST_INSERT_TAIL(head, elm, field)                             \
+    do {                                                                \
+        (elm)->field.next = NULL;                                       \
+        (elm)->field.prev = (head)->last;                               \
+        if (NULL != (head)->last)                                       \
+        {                                                               \
+            (head)->last->field.next = (elm);                           \
+        }                                                               \
+        else                                                            \
+        {                                                               \
+            (head)->first = (elm);                                      \
+        }                                                               \
+        (head)->last = (elm);                                           \
+        (head)->len ++;                                                 \
+    } while (0)
+
+/* Remove elm from list head and clear its links. */
+#define ILIST_REMOVE(head, elm, field)                                  \
+    do {                                                                \
+        if (NULL != (elm)->field.prev)                                  \
+        {                                                               \
+            (elm)->field.prev->field.next = (elm)->field.next;          \
+        }                                                               \
+        else                                                            \
+        {                                                               \
+            (head)->first = (elm)->field.next;                          \
+        }                                                               \
+        if (NULL != (elm)->field.next)                                  \
+        {                                                               \
+            (elm)->field.next->field.prev = (elm)->field.prev;          \
+        }                                                               \
+        else                                                            \
+        {                                                               \
+            (head)->last = (elm)->field.prev;                           \
+        }                                                               \
+        (elm)->field.prev = NULL;                                       \
+        (elm)->field.next = NULL;                                       \
+        (head)->len --;                                                 \
+    } while (0)
+
+/* Move elm, which must be on list head, to the head of the list. */
+#define ILIST_MOVE_TO_HEAD(head, elm, field)                            \
+    do {                                                                \
+        if ((head)->first != (elm))                                     \
+        {                                                               \
+            ILIST_REMOVE(head, elm, field);                             \
+            ILIST_INSERT_HEAD(head, elm, field);                        \
+        }                                                               \
+    } while (0)
+
+/* Size of one slab of pool objects, in bytes. */
+#define POOL_SLABSIZE 4096
+
+/*
+ * Allocator for objects of one fixed size. Objects are carved out of
+ * page sized slabs and freed objects are kept on a free list for
+ * reuse, so allocating and freeing is cheap and doesn't fragment the
+ * heap. Slabs are never given back.
+ *
+ * Use POOL_INIT(type) to initialize.
+ */
+struct pool
+{
+    size_t size;                /* Object size. */
+    void *freelist;             /* Free objects, linked through first word. */
+    void *slabs;                /* All slabs, linked through first word. */
+    unsigned nslabs;            /* Number of slabs allocated. */
+    unsigned inuse;             /* Objects currently handed out. */
+    unsigned peak;              /* Most objects ever handed out at once. */
+    unsigned long allocs;       /* Number of poolget() calls. */
+};
+
+#define POOL_INIT(type) { sizeof (type), NULL, NULL, 0, 0, 0, 0 }
+
+/* The pool all list items are allocated from. */
+extern struct pool itempool;
+
+/*
+ * Get an object from pool.
+ *
+ * Returns object or NULL if out of memory.
+ */
+void *poolget(struct pool *pool);
+
+/*
+ * Give object obj back to pool.
+ */
+void poolput(struct pool *pool, void *obj);
+
+/*
+ * Print statistics about pool, named name, on stdout.
+ */
+void poolstats(struct pool *pool, const char *name);
+
 /*
  * Move element in item to the head of list mainlist.
  */
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "loop.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/* Most events we handle from one epoll_wait(). */
+#define LOOP_MAXEVENTS 16
+
+struct watch
+{
+    int fd;
+    watchfn fn;
+    void *arg;
+    bool timer;                /* Our own timerfd? */
+    bool dead;                 /* Unwatched, waiting to be freed. */
+    struct watch *prev;
+    struct watch *next;
+};
+
+static int epfd = -1;           /* The epoll file descriptor. */
+static struct watch *watches;   /* Everything we watch. */
+static struct watch *dead;      /* Unwatched, not yet freed. */
+
+int loopinit(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == epfd)
+    {
+        perror("mcwm: epoll_create1");
+        return -1;
+    }
+
+    return 0;
+}
+
+struct watch *loopwatch(int fd, watchfn fn, void *arg)
+{
+    struct watch *watch;
+    struct epoll_event ev;
+
+    if (NULL == (watch = malloc(sizeof (struct watch))))
+    {
+        return NULL;
+    }
+
+    watch->fd = fd;
+    watch->fn = fn;
+    watch->arg = arg;
+    watch->timer = false;
+    watch->dead = false;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = watch;
+
+    if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+    {
+        perror("mcwm: epoll_ctl");
+        free(watch);
+        return NULL;
+    }
+
+    watch->prev = NULL;
+    watch->next = watches;
+    if (NULL != watches)
+    {
+        watches->prev = watch;
+    }
+    watches = watch;
+
+    return watch;
+}
+
+void loopunwatch(struct watch *watch)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+    if (watch->timer)
+    {
+        close(watch->fd);
+    }
+
+    if (NULL != watch->prev)
+    {
+        watch->prev->next = watch->next;
+    }
+    else
+    {
+        watches = watch->next;
+    }
+
+    if (NULL != watch->next)
+    {
+        watch->next->prev = watch->prev;
+    }
+
+    /*
+     * looprun() might be about to call this watch from the same
+     * batch of events. Don't free it until it's done.
+     */
+    watch->dead = true;
+    watch->next = dead;
+    dead = watch;
+}
+
+struct watch *looptimer(watchfn fn, void *arg)
+{
+    struct watch *watch;
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == fd)
+    {
+        perror("mcwm: timerfd_create");
+        return NULL;
+    }
+
+    if (NULL == (watch = loopwatch(fd, fn, arg)))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    watch->timer = true;
+
+    return watch;
+}
+
+int looparm(struct watch *timer, int64_t usec)
+{
+    struct itimerspec its;
+
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec = usec / 1000000;
+    its.it_value.tv_nsec = (usec % 1000000) * 1000;
+
+    if (-1 == timerfd_settime(timer->fd, 0, &its, NULL))
+    {
+        perror("mcwm: timerfd_settime");
+        return -1;
+    }
+
+    return 0;
+}
+
+int looprun(int timeout)
+{
+    struct epoll_event evs[LOOP_MAXEVENTS];
+    struct watch *watch;
+    uint64_t expired;
+    int n;
+    int i;
+
+    n = epoll_wait(epfd, evs, LOOP_MAXEVENTS, timeout);
+    if (-1 == n)
+    {
+        if (EINTR == errno)
+        {
+            return 0;
+        }
+
+        perror("mcwm: epoll_wait");
+        return -1;
+    }
+
+    for (i = 0; i < n; i ++)
+    {
+        watch = evs[i].data.ptr;
+
+        if (watch->dead)
+        {
+            continue;
+        }
+
+        if (watch->timer)
+        {
+            /*
+             * Acknowledge the expiry or we'll be woken up again. A
+             * timer disarmed after it expired has nothing to read.
+             */
+            if (-1 == read(watch->fd, &expired, sizeof expired))
+            {
+                continue;
+            }
+        }
+
+        if (NULL != watch->fn)
+        {
+            watch->fn(watch->arg);
+        }
+    }
+
+    while (NULL != dead)
+    {
+        watch = dead;
+        dead = watch->next;
+        free(watch);
+    }
+
+    return n;
+}
+
+void loopfree(void)
+{
+    struct watch *watch;
+
+    while (NULL != watches)
+    {
+        loopunwatch(watches);
+    }
+
+    while (NULL != dead)
+    {
+        watch = dead;
+        dead = watch->next;
+        free(watch);
+    }
+
+    if (-1 != epfd)
+    {
+        close(epfd);
+        epfd = -1;
+    }
+}
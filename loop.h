@@ -0,0 +1,67 @@
+#include <stdint.h>
+
+/*
+ * Event loop built on epoll. Watch file descriptors and get called
+ * when they have something to read. Timers are timerfds, watched
+ * like any other file descriptor.
+ *
+ * Adding something new to wait for, such as a control socket, is
+ * just another loopwatch().
+ */
+struct watch;
+
+/*
+ * Function called when a watched file descriptor is readable or a
+ * timer expires. arg is what was given to loopwatch() or looptimer().
+ */
+typedef void (*watchfn)(void *arg);
+
+/*
+ * Set up the event loop.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int loopinit(void);
+
+/*
+ * Call fn with arg every time fd is readable. fn may be NULL if we
+ * only want looprun() to return when fd is readable.
+ *
+ * Returns the new watch or NULL on error.
+ */
+struct watch *loopwatch(int fd, watchfn fn, void *arg);
+
+/*
+ * Stop watching. Timers are closed, other file descriptors are left
+ * open. Safe to call from a watch function.
+ */
+void loopunwatch(struct watch *watch);
+
+/*
+ * Create a timer calling fn with arg when it expires. The timer
+ * starts disarmed.
+ *
+ * Returns the new timer or NULL on error.
+ */
+struct watch *looptimer(watchfn fn, void *arg);
+
+/*
+ * Make timer expire once, usec microseconds from now. If usec is 0,
+ * disarm timer instead.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int looparm(struct watch *timer, int64_t usec);
+
+/*
+ * Wait at most timeout milliseconds, or forever if timeout is -1,
+ * for anything we watch and call the watch functions of everything
+ * that's ready.
+ *
+ * Returns the number of watches that were ready, 0 if we timed out
+ * or were interrupted, -1 on error.
+ */
+int looprun(int timeout);
+
+/* Stop watching everything and free all memory used by the loop. */
+void loopfree(void);
@@ -33,10 +33,11 @@
 #include <string.h>
 #include <signal.h>
 #include <assert.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
 
 #include <xcb/xcb.h>
 #include <xcb/randr.h>
@@ -54,6 +55,9 @@
 #endif
 
 #include "list.h"
+#include "hash.h"
+#include "loop.h"
+#include "snap.h"
 
 /* Check here for user configurable parts: */
 #include "config.h"
@@ -86,8 +90,15 @@
  */
 #define MCWM_TABBING 4
 
-/* Number of workspaces. */
-#define WORKSPACES 10
+/* Most workspaces we can have, one bit each in a client's wsmask. */
+#define MAXWORKSPACES 64
+
+/* The bit in wsmask for workspace ws. */
+#define WSBIT(ws) ((uint64_t) 1 << (ws))
+
+/* Walk all windows on workspace ws, fixed windows last. */
+#define WS_FOREACH(var, ws)                                             \
+    for ((var) = wsfirst(ws); NULL != (var); (var) = wsnext((var), (ws)))
 
 /* Value in WM hint which means this window is fixed on all workspaces. */
 #define NET_WM_FIXED 0xffffffff
@@ -95,6 +106,27 @@
 /* This means we didn't get any window hint at all. */
 #define MCWM_NOWS 0xfffffffe
 
+/* Keycode is bound to an action with MODKEY. */
+#define GRAB_PLAIN 1
+
+/* Keycode is bound to an action with MODKEY and SHIFTMOD. */
+#define GRAB_SHIFTED 2
+
+/*
+ * Microseconds to wait after a keyboard MappingNotify for more of
+ * them before we set up our keys again.
+ */
+#define KEYMAP_SETTLE 100000
+
+/*
+ * Microseconds to wait after a RANDR notify for more of them before
+ * we update our monitors.
+ */
+#define RANDR_SETTLE 100000
+
+/* Refresh rate in Hz to assume if RANDR doesn't tell us. */
+#define DRAG_DEFAULTRATE 60
+
 
 /* Types. */
 
@@ -135,15 +167,48 @@ typedef enum {
     KEY_MAX
 } key_enum_t;
 
+/* A list of clients, linked through the clients themselves. */
+ILIST_HEAD(clientlist, client);
+
 struct monitor
 {
     xcb_randr_output_t id;
+    xcb_randr_crtc_t crtc;     /* CRTC showing it. XCB_NONE if none. */
+    xcb_randr_mode_t mode;     /* Mode of the CRTC. */
     char *name;
     int16_t x;                 /* X and Y. */
     int16_t y;
     uint16_t width;     /* Width in pixels. */
     uint16_t height;    /* Height in pixels. */
+    unsigned refresh;   /* Refresh rate in mHz. 0 if unknown. */
     struct item *item; /* Pointer to our place in output list. */
+    struct clientlist clients;  /* Windows on this monitor. */
+    bool dirty;                /* Changed since we fitted windows. */
+    bool clones;               /* Other outputs show the same. */
+};
+
+/* An output change we have been told about but not acted on yet. */
+struct outputchange
+{
+    xcb_randr_output_change_t change;
+    bool asked;                /* Asked the X server about it? */
+    xcb_randr_get_output_info_cookie_t ocookie;
+    xcb_randr_get_crtc_info_cookie_t ccookie;
+};
+
+/*
+ * RANDR changes waiting for the configuration to settle. Only the
+ * latest change to every CRTC and output is kept.
+ */
+struct randrchanges
+{
+    xcb_randr_crtc_change_t *crtcs;
+    unsigned ncrtcs;
+    unsigned crtcsize;          /* Room for this many CRTC changes. */
+    struct outputchange *outputs;
+    unsigned noutputs;
+    unsigned outputsize;        /* Room for this many output changes. */
+    xcb_timestamp_t timestamp;  /* Latest configuration time. */
 };
 
 struct sizepos
@@ -171,10 +236,76 @@ struct client
     bool vertmaxed;             /* Vertically maximized? */
     bool maxed;                 /* Totally maximized? */
     bool fixed;           /* Visible on all workspaces? */
+    uint64_t wsmask;            /* Workspaces we're on unless fixed. */
+    bool parked;                /* Hidden off screen? */
+    unsigned int unmapseq;      /* Sequence number of our last unmap. */
     struct monitor *monitor;    /* The physical output this window is on. */
-    struct item *winitem; /* Pointer to our place in global windows list. */
-    struct item *wsitem[WORKSPACES]; /* Pointer to our place in every
-                                      * workspace window list. */
+    struct sizepos sent;        /* Geometry we last sent to the X server. */
+    ILIST_LINK(client) winlink; /* Our place in global windows list. */
+    ILIST_LINK(client) monlink; /* Our place in our monitor's list. */
+    ILIST_LINK(client) dirtylink; /* Our place in list of windows with
+                                   * geometry changes not yet sent. */
+    ILIST_LINK(client) stickylink; /* Our place in fixed windows list. */
+    ILIST_LINK(client) wslink[]; /* Our place in every workspace window
+                                  * list, conf.workspaces of them. */
+};
+
+/* Outstanding requests about a window we're about to manage. */
+struct wincookies
+{
+    xcb_get_geometry_cookie_t geom;
+    xcb_get_property_cookie_t hints;
+};
+
+/* Outstanding requests about a window already there when we start. */
+struct adoption
+{
+    xcb_get_window_attributes_cookie_t attr;
+    struct wincookies win;
+    xcb_get_property_cookie_t desktop;
+    bool manage;                /* Will we manage it? */
+};
+
+/* Moving or resizing a window with the mouse. */
+struct drag
+{
+    int64_t interval;           /* Microseconds between window updates. */
+    int64_t last;               /* When we last updated the window. */
+    int16_t x;                  /* Newest pointer position. */
+    int16_t y;
+    bool pending;               /* Newest position not yet applied? */
+};
+
+/*
+ * Which monitor covers what part of the root window. The edges of all
+ * monitors cut the root window into a grid of cells. Every cell is
+ * covered by a single monitor or none at all.
+ */
+struct monmap
+{
+    int32_t *xs;                /* Sorted X coordinates of cell edges. */
+    int32_t *ys;                /* Sorted Y coordinates of cell edges. */
+    unsigned nx;                /* Number of X edges. */
+    unsigned ny;                /* Number of Y edges. */
+    struct monitor **cells;     /* (nx - 1) * (ny - 1) cells, by row. */
+};
+
+/* A colour being looked up. */
+struct colour
+{
+    const char *name;           /* Name or #RGB hex value. */
+    uint32_t *pixel;            /* Where to store the pixel value. */
+    bool pending;               /* Waiting for the X server? */
+    xcb_alloc_named_color_cookie_t cookie;
+};
+
+/* Events read from the X server, waiting to be handled. */
+struct batch
+{
+    xcb_generic_event_t **evs;
+    unsigned len;               /* Number of events in batch. */
+    unsigned size;              /* Room for this many. */
+    unsigned next;              /* Next event to handle. */
 };
 
 /* Window configuration data. */
@@ -194,6 +325,8 @@ struct winconf
 
 int sigcode;                    /* Signal code. Non-zero if we've been
                                  * interruped by a signal. */
+sigset_t sigmask;               /* Signal mask we started with. */
+int sigfd;                      /* Where we read signals. */
 xcb_connection_t *conn;         /* Connection to X server. */
 xcb_screen_t *screen;           /* Our current screen.  */
 int randrbase;                  /* Beginning of RANDR extension events. */
@@ -203,27 +336,37 @@ struct client *lastfocuswin;        /* Last focused window. NOTE! Only
                                      * used to communicate between
                                      * start and end of tabbing
                                      * mode. */
-struct item *winlist = NULL;    /* Global list of all client windows. */
+struct clientlist winlist;      /* Global list of all client windows. */
+struct hash winhash;            /* All client windows, by window ID. */
+struct clientlist dirtylist;    /* Windows with geometry not yet sent. */
+struct pool clientpool = POOL_INIT(struct client); /* Client allocator. */
 struct item *monlist = NULL;    /* List of all physical monitor outputs. */
+struct monmap monmap;           /* Monitors by coordinate. */
+struct hash monhash;            /* Monitors by RANDR output ID. */
+xcb_randr_get_screen_resources_current_reply_t *randrres; /* Last
+                                 * RANDR resources we got. */
+struct randrchanges randrchanges; /* RANDR changes not yet applied. */
+struct watch *randrtimer;       /* Time to apply RANDR changes. */
 int mode = 0;                   /* Internal mode, such as move or resize */
+struct drag drag;               /* Pointer state when moving or resizing. */
+struct watch *dragtimer;        /* Time for next update when dragging. */
+struct watch *keymaptimer;      /* Time to use a changed keyboard mapping. */
+struct batch batch;             /* Events we're handling right now. */
+struct hash confhash;           /* ConfigureRequests in batch, by window. */
+struct snapindex snapidx;       /* Edges we can snap to. */
+struct client *snapclient;      /* Window snapidx was built for. */
+uint32_t snapgen;               /* geomgen when snapidx was built. */
+uint32_t geomgen;               /* Bumped when windows on current
+                                 * workspace might have changed. */
 
 /*
  * Workspace list: Every workspace has a list of all visible
  * windows.
  */
-struct item *wslist[WORKSPACES] =
-{
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL
-};
+struct clientlist *wslist;
+
+/* Windows on all workspaces. Not on any of the lists in wslist. */
+struct clientlist stickylist;
 
 /* Shortcut key type and initializiation. */
 struct keys
@@ -266,6 +409,31 @@ struct keys
     { USERKEY_MENU, 0 },
 };
 
+/* Function doing what a key is bound to, with the binding's arg. */
+typedef void (*keyfn)(int arg);
+
+/* What a key does. */
+struct keyaction
+{
+    keyfn fn;                   /* NULL if the key does nothing. */
+    int arg;
+};
+
+/*
+ * What every keycode does when pressed with MODKEY, without and with
+ * SHIFTMOD. Built by setupkeys().
+ */
+struct keyaction keytable[256][2];
+
+/* Modifiers that are locked rather than held. We ignore them. */
+uint16_t lockmask = XCB_MOD_MASK_LOCK;
+
+/* What every keycode is grabbed for, GRAB_* bits. */
+uint8_t keygrabs[256];
+
+/* Keycodes bound to any modifier. */
+bool modifierkeys[256];
+
 /* All keycodes generating our MODKEY mask. */
 struct modkeycodes
 {
@@ -287,6 +455,9 @@ struct conf
     uint32_t unfocuscol;        /* Unfocused border colour.  */
     uint32_t fixedcol;          /* Fixed windows border colour. */
     bool allowicons;            /* Allow windows to be unmapped. */
+    bool parkwindows;           /* Hide windows off screen, not unmapped. */
+    bool trace;                 /* Print how long startup takes. */
+    uint32_t workspaces;        /* Number of workspaces. */
 } conf;
 
 xcb_atom_t atom_desktop;        /*
@@ -300,58 +471,120 @@ xcb_atom_t wm_change_state;
 xcb_atom_t wm_state;
 xcb_atom_t wm_protocols;        /* WM_PROTOCOLS.  */
 
+/* All atoms we need and where to keep them. */
+struct
+{
+    const char *name;
+    xcb_atom_t *atom;
+} atoms[] =
+{
+    { "_NET_WM_DESKTOP", &atom_desktop },
+    { "WM_DELETE_WINDOW", &wm_delete_window },
+    { "WM_CHANGE_STATE", &wm_change_state },
+    { "WM_STATE", &wm_state },
+    { "WM_PROTOCOLS", &wm_protocols },
+};
+
+#define NATOMS (sizeof atoms / sizeof atoms[0])
+
+int64_t tracestart;             /* When we started. */
+int64_t tracelast;              /* When the last startup phase ended. */
+
 
 /* Functions declerations. */
 
 static void finishtabbing(void);
-static struct modkeycodes getmodkeys(xcb_mod_mask_t modmask);
+static bool tabgrab(void);
+static void movetowshead(struct client *client);
+static struct modkeycodes getmodkeys(xcb_get_modifier_mapping_reply_t *reply,
+                                     xcb_mod_mask_t modmask);
 static void cleanup(int code);
 static void arrangewindows(void);
 static void setwmdesktop(xcb_drawable_t win, uint32_t ws);
-static int32_t getwmdesktop(xcb_drawable_t win);
+static int32_t getwmdesktop(xcb_drawable_t win,
+                            xcb_get_property_cookie_t cookie);
 static void addtoworkspace(struct client *client, uint32_t ws);
 static void delfromworkspace(struct client *client, uint32_t ws);
+static void delfromworkspaces(struct client *client);
 static void changeworkspace(uint32_t ws);
+static bool onworkspace(struct client *client, uint32_t ws);
+static struct client *wsfirst(uint32_t ws);
+static struct client *wslast(uint32_t ws);
+static struct client *wsnext(struct client *client, uint32_t ws);
+static struct client *wsprev(struct client *client, uint32_t ws);
+static void hidefromws(struct client *client);
+static void unmapwin(struct client *client);
+static void park(struct client *client);
+static void unpark(struct client *client);
+static void setwmstate(xcb_drawable_t win, uint32_t state);
 static void fixwindow(struct client *client, bool setcolour);
-static uint32_t getcolor(const char *colstr);
+static void askcolour(struct colour *col);
+static void getcolour(struct colour *col);
+static bool parsehex(const char *str, uint16_t rgb[3]);
+static xcb_visualtype_t *findvisual(xcb_visualid_t id);
 static void forgetclient(struct client *client);
 static void forgetwin(xcb_window_t win);
 static void fitonscreen(struct client *client);
 static void newwin(xcb_window_t win);
-static struct client *setupwin(xcb_window_t win);
+static void getwininfo(xcb_window_t win, struct wincookies *cookies);
+static struct client *setupwin(xcb_window_t win,
+                               struct wincookies *cookies);
 static xcb_keycode_t keysymtokeycode(xcb_keysym_t keysym,
                                      xcb_key_symbols_t *keysyms);
-static int setupkeys(void);
-static int setupscreen(void);
+static int setupkeys(xcb_key_symbols_t *keysyms,
+                     xcb_get_modifier_mapping_cookie_t modcookie);
+static int setupscreen(xcb_query_tree_cookie_t treecookie);
 static int setuprandr(void);
 static void getrandr(void);
 static void getoutputs(xcb_randr_output_t *outputs, int len,
-                       xcb_timestamp_t timestamp);
+                       xcb_randr_crtc_t *crtcs, int ncrtcs,
+                       xcb_timestamp_t timestamp,
+                       xcb_randr_mode_info_t *modes, int nmodes);
+static unsigned moderefresh(xcb_randr_mode_info_t *modes, int nmodes,
+                            xcb_randr_mode_t id);
+static unsigned refreshnow(xcb_randr_mode_t id);
+static void randrnotify(xcb_randr_notify_event_t *e);
+static void randrtimeout(void *arg);
+static bool randrunknown(struct randrchanges *ch);
+static void dropmonitor(struct monitor *mon);
+static void dropmonitors(void);
+static void fitmonitors(void);
 void arrbymon(struct monitor *monitor);
 static struct monitor *findmonitor(xcb_randr_output_t id);
+static struct monitor *findmonbycrtc(xcb_randr_crtc_t crtc);
 static struct monitor *findclones(xcb_randr_output_t id, int16_t x, int16_t y);
+static int buildmonmap(void);
+static unsigned addedges(int32_t *edges, unsigned n);
+static int cmpedge(const void *a, const void *b);
+static int findedge(const int32_t *edges, unsigned n, int32_t value);
 static struct monitor *findmonbycoord(int16_t x, int16_t y);
+static void setmonitor(struct client *client, struct monitor *mon);
 static void delmonitor(struct monitor *mon);
 static struct monitor *addmonitor(xcb_randr_output_t id, char *name,
                                   uint32_t x, uint32_t y, uint16_t width,
-                                  uint16_t height);
+                                  uint16_t height, unsigned refresh);
 static void raisewindow(xcb_drawable_t win);
 static void raiseorlower(struct client *client);
 static void movelim(struct client *client);
-static void movewindow(xcb_drawable_t win, uint16_t x, uint16_t y);
+static void updategeom(struct client *client);
+static bool sendgeom(struct client *client);
+static void commitgeom(void);
+static void configurenotify(struct client *client);
+static void warppointer(struct client *client, int16_t x, int16_t y);
 static struct client *findclient(xcb_drawable_t win);
 static void focusnext(bool reverse);
 static void setunfocus(xcb_drawable_t win);
 static void setfocus(struct client *client);
 static int start(char *program);
 static void resizelim(struct client *client);
-static void moveresize(xcb_drawable_t win, uint16_t x, uint16_t y,
-                       uint16_t width, uint16_t height);
-static void resize(xcb_drawable_t win, uint16_t width, uint16_t height);
 static void resizestep(struct client *client, char direction);
 static void snapwindow(struct client *client, int snap_mode);
 static void mousemove(struct client *client, int rel_x, int rel_y);
 static void mouseresize(struct client *client, int rel_x, int rel_y);
+static int64_t draginterval(struct monitor *mon, int64_t rtt);
+static void dragupdate(void);
+static void dragtimeout(void *arg);
+static void keymaptimeout(void *arg);
 static void movestep(struct client *client, char direction);
 static void setborders(struct client *client, int width);
 static void unmax(struct client *client);
@@ -359,8 +592,6 @@ static void maximize(struct client *client);
 static void maxvert(struct client *client);
 static void hide(struct client *client);
 static bool getpointer(xcb_drawable_t win, int16_t *x, int16_t *y);
-static bool getgeom(xcb_drawable_t win, int16_t *x, int16_t *y, uint16_t *width,
-                    uint16_t *height);
 static void topleft(void);
 static void topright(void);
 static void botleft(void);
@@ -371,10 +602,81 @@ static void nextscreen(void);
 static void handle_keypress(xcb_key_press_event_t *ev);
 static void configwin(xcb_window_t win, uint16_t mask, struct winconf wc);
 static void configurerequest(xcb_configure_request_event_t *e);
+static int setuploop(void);
+static unsigned readbatch(void);
+static bool growbatch(void);
+static void addtobatch(xcb_generic_event_t *ev);
+static void mergeconfig(xcb_configure_request_event_t *to,
+                        xcb_configure_request_event_t *from);
 static void events(void);
 static void printhelp(void);
-static void sigcatch(int sig);
-static xcb_atom_t getatom(char *atom_name);
+static int setupsignals(void);
+static void readsignals(void *arg);
+static void askatoms(xcb_intern_atom_cookie_t *cookies);
+static void getatoms(xcb_intern_atom_cookie_t *cookies);
+static void trace(const char *phase);
+static int64_t monotime(void);
+static uint16_t getmodifiers(xcb_get_modifier_mapping_reply_t *reply,
+                             xcb_key_symbols_t *keysyms, bool *modifiers);
+static bool keyinlist(xcb_keycode_t *list, xcb_keycode_t keycode);
+static void grabkey(xcb_keycode_t keycode, uint16_t modifiers);
+static void keyfix(int arg);
+static void keymove(int arg);
+static void keyresize(int arg);
+static void keyfocus(int arg);
+static void keymaxvert(int arg);
+static void keyraise(int arg);
+static void keymax(int arg);
+static void keyterminal(int arg);
+static void keymenu(int arg);
+static void keyws(int arg);
+static void keyprevws(int arg);
+static void keynextws(int arg);
+static void keycorner(int arg);
+static void keydelete(int arg);
+static void keyscreen(int arg);
+static void keyiconify(int arg);
+
+/*
+ * What every key in keys[] does, without and with SHIFTMOD. Keys
+ * without an action for a modifier state are ignored in that state.
+ */
+const struct keyaction keyactions[KEY_MAX][2] =
+{
+    [KEY_F] = { { keyfix, 0 }, { NULL, 0 } },
+    [KEY_H] = { { keymove, 'h' }, { keyresize, 'h' } },
+    [KEY_J] = { { keymove, 'j' }, { keyresize, 'j' } },
+    [KEY_K] = { { keymove, 'k' }, { keyresize, 'k' } },
+    [KEY_L] = { { keymove, 'l' }, { keyresize, 'l' } },
+    [KEY_M] = { { keymaxvert, 0 }, { NULL, 0 } },
+    [KEY_R] = { { keyraise, 0 }, { NULL, 0 } },
+    [KEY_RET] = { { keyterminal, 0 }, { NULL, 0 } },
+    [KEY_X] = { { keymax, 0 }, { NULL, 0 } },
+    /* Shifted tab counts as backtab. */
+    [KEY_TAB] = { { keyfocus, false }, { keyfocus, true } },
+    [KEY_BACKTAB] = { { keyfocus, true }, { NULL, 0 } },
+    [KEY_1] = { { keyws, 0 }, { NULL, 0 } },
+    [KEY_2] = { { keyws, 1 }, { NULL, 0 } },
+    [KEY_3] = { { keyws, 2 }, { NULL, 0 } },
+    [KEY_4] = { { keyws, 3 }, { NULL, 0 } },
+    [KEY_5] = { { keyws, 4 }, { NULL, 0 } },
+    [KEY_6] = { { keyws, 5 }, { NULL, 0 } },
+    [KEY_7] = { { keyws, 6 }, { NULL, 0 } },
+    [KEY_8] = { { keyws, 7 }, { NULL, 0 } },
+    [KEY_9] = { { keyws, 8 }, { NULL, 0 } },
+    [KEY_0] = { { keyws, 9 }, { NULL, 0 } },
+    [KEY_Y] = { { keycorner, 0 }, { NULL, 0 } },
+    [KEY_U] = { { keycorner, 1 }, { NULL, 0 } },
+    [KEY_B] = { { keycorner, 2 }, { NULL, 0 } },
+    [KEY_N] = { { keycorner, 3 }, { NULL, 0 } },
+    [KEY_END] = { { keydelete, 0 }, { NULL, 0 } },
+    [KEY_PREVSCR] = { { keyscreen, false }, { NULL, 0 } },
+    [KEY_NEXTSCR] = { { keyscreen, true }, { NULL, 0 } },
+    [KEY_ICONIFY] = { { keyiconify, 0 }, { NULL, 0 } },
+    [KEY_PREVWS] = { { keyprevws, 0 }, { NULL, 0 } },
+    [KEY_NEXTWS] = { { keynextws, 0 }, { NULL, 0 } },
+    [KEY_MENU] = { { keymenu, 0 }, { NULL, 0 } },
+};
 
 
 /* Function bodies. */
@@ -394,23 +696,175 @@ void finishtabbing(void)
 {
     mode = 0;
 
+    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+
     if (NULL != lastfocuswin)
     {
-        movetohead(&wslist[curws], lastfocuswin->wsitem[curws]);
+        movetowshead(lastfocuswin);
         lastfocuswin = NULL;
     }
 
-    movetohead(&wslist[curws], focuswin->wsitem[curws]);
+    movetowshead(focuswin);
+}
+
+/*
+ * Grab the keyboard while tabbing so we see MODKEY being released.
+ * Otherwise we only get the keys we have bound.
+ *
+ * Returns true if MODKEY is still held once we have the grab, false
+ * if it's already released or we couldn't grab the keyboard.
+ */
+bool tabgrab(void)
+{
+    xcb_grab_keyboard_reply_t *grab;
+    xcb_query_pointer_reply_t *pointer;
+    bool held = false;
+
+    grab = xcb_grab_keyboard_reply(
+        conn, xcb_grab_keyboard(conn, false, screen->root, XCB_CURRENT_TIME,
+                                XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC),
+        NULL);
+    if (NULL == grab || XCB_GRAB_STATUS_SUCCESS != grab->status)
+    {
+        PDEBUG("Couldn't grab keyboard.\n");
+        free(grab);
+        return false;
+    }
+    free(grab);
+
+    /* MODKEY might have been released before we got the grab. */
+    pointer = xcb_query_pointer_reply(conn,
+                                      xcb_query_pointer(conn, screen->root),
+                                      NULL);
+    if (NULL != pointer)
+    {
+        held = 0 != (pointer->mask & MODKEY);
+        free(pointer);
+    }
+
+    return held;
+}
+
+/*
+ * Find the keycodes bound to modifiers in the modifier mapping reply
+ * and set them in the 256 entries of modifiers. Also find the modifiers NumLock and
+ * ScrollLock are on. Together with CapsLock, those are the modifiers
+ * we ignore.
+ *
+ * Returns the mask of all lock modifiers.
+ */
+uint16_t getmodifiers(xcb_get_modifier_mapping_reply_t *reply,
+                      xcb_key_symbols_t *keysyms, bool *modifiers)
+{
+    xcb_keycode_t *modmap;
+    xcb_keycode_t *numlock;
+    xcb_keycode_t *scrolllock;
+    uint16_t mask = XCB_MOD_MASK_LOCK;
+    unsigned mod;
+    unsigned i;
+    xcb_keycode_t keycode;
+
+    numlock = xcb_key_symbols_get_keycode(keysyms, XK_Num_Lock);
+    scrolllock = xcb_key_symbols_get_keycode(keysyms, XK_Scroll_Lock);
+
+    /* Keycodes of all eight modifiers, as in getmodkeys(). */
+    modmap = xcb_get_modifier_mapping_keycodes(reply);
+    for (mod = 0; mod < 8; mod ++)
+    {
+        for (i = 0; i < reply->keycodes_per_modifier; i ++)
+        {
+            keycode = modmap[mod * reply->keycodes_per_modifier + i];
+            if (0 == keycode)
+            {
+                continue;
+            }
+
+            modifiers[keycode] = true;
+
+            if (keyinlist(numlock, keycode)
+                || keyinlist(scrolllock, keycode))
+            {
+                mask |= 1 << mod;
+            }
+        }
+    }
+
+    PDEBUG("Lock modifier mask: %x\n", mask);
+
+    free(numlock);
+    free(scrolllock);
+
+    return mask;
+}
+
+/*
+ * Is keycode in list? list is ended by XCB_NO_SYMBOL and may be
+ * NULL.
+ */
+bool keyinlist(xcb_keycode_t *list, xcb_keycode_t keycode)
+{
+    if (NULL == list)
+    {
+        return false;
+    }
+
+    for (; XCB_NO_SYMBOL != *list; list ++)
+    {
+        if (keycode == *list)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Grab keycode with modifiers, whatever lock modifiers are on as
+ * well.
+ */
+void grabkey(xcb_keycode_t keycode, uint16_t modifiers)
+{
+    uint16_t locks = 0;
+
+    /* Every subset of lockmask, starting and ending with none. */
+    do
+    {
+        xcb_grab_key(conn, 1, screen->root, modifiers | locks, keycode,
+                     XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+        locks = (locks - lockmask) & lockmask;
+    } while (0 != locks);
+}
+
+/*
+ * Move client to the head of the current workspace window list, if
+ * it's on the current workspace at all.
+ */
+void movetowshead(struct client *client)
+{
+    if (NULL == client || !onworkspace(client, curws))
+    {
+        return;
+    }
+
+    if (client->fixed)
+    {
+        ILIST_MOVE_TO_HEAD(&stickylist, client, stickylink);
+    }
+    else
+    {
+        ILIST_MOVE_TO_HEAD(&wslist[curws], client, wslink[curws]);
+    }
 }
 
 /*
- * Find out what keycode modmask is bound to. Returns a struct. If the
- * len in the struct is 0 something went wrong.
+ * Find out what keycode modmask is bound to in the modifier mapping
+ * reply. Returns a struct. If the len in the struct is 0 something
+ * went wrong.
  */
-struct modkeycodes getmodkeys(xcb_mod_mask_t modmask)
+struct modkeycodes getmodkeys(xcb_get_modifier_mapping_reply_t *reply,
+                              xcb_mod_mask_t modmask)
 {
-    xcb_get_modifier_mapping_cookie_t cookie;
-    xcb_get_modifier_mapping_reply_t *reply;
     xcb_keycode_t *modmap;
     struct modkeycodes keycodes = {
         NULL,
@@ -427,13 +881,6 @@ struct modkeycodes getmodkeys(xcb_mod_mask_t modmask)
                                       XCB_MOD_MASK_4,
                                       XCB_MOD_MASK_5 };
 
-    cookie = xcb_get_modifier_mapping_unchecked(conn);
-
-    if ((reply = xcb_get_modifier_mapping_reply(conn, cookie, NULL)) == NULL)
-    {
-        return keycodes;
-    }
-
     if (NULL == (keycodes.keycodes = calloc(reply->keycodes_per_modifier,
                                             sizeof (xcb_keycode_t))))
     {
@@ -475,8 +922,6 @@ struct modkeycodes getmodkeys(xcb_mod_mask_t modmask)
         }
     }
 
-    free(reply);
-
     return keycodes;
 }
 
@@ -489,6 +934,28 @@ struct modkeycodes getmodkeys(xcb_mod_mask_t modmask)
  */
 void cleanup(int code)
 {
+    struct client *client;
+
+    D(poolstats(&clientpool, "client"));
+    D(poolstats(&itempool, "item"));
+
+    /*
+     * Don't leave windows off screen where nobody can find them.
+     * Leave them where they belong but unmapped, like we would have
+     * hidden them without parking.
+     */
+    ILIST_FOREACH(client, &winlist, winlink)
+    {
+        if (client->parked)
+        {
+            unpark(client);
+            xcb_unmap_window(conn, client->id);
+        }
+    }
+    commitgeom();
+
+    loopfree();
+
     xcb_set_input_focus(conn, XCB_NONE,
                         XCB_INPUT_FOCUS_POINTER_ROOT,
                         XCB_CURRENT_TIME);
@@ -502,16 +969,14 @@ void cleanup(int code)
  */
 void arrangewindows(void)
 {
-    struct item *item;
     struct client *client;
 
     /*
      * Go through all windows. If they don't fit on the new screen,
      * move them around and resize them as necessary.
      */
-    for (item = winlist; item != NULL; item = item->next)
+    ILIST_FOREACH(client, &winlist, winlink)
     {
-        client = item->data;
         fitonscreen(client);
     }
 }
@@ -528,22 +993,18 @@ void setwmdesktop(xcb_drawable_t win, uint32_t ws)
 
 /*
  * Get EWWM hint so we might know what workspace window win should be
- * visible on.
+ * visible on. cookie is a pending request for the _NET_WM_DESKTOP
+ * property of win.
  *
  * Returns either workspace, NET_WM_FIXED if this window should be
  * visible on all workspaces or MCWM_NOWS if we didn't find any hints.
  */
-int32_t getwmdesktop(xcb_drawable_t win)
+int32_t getwmdesktop(xcb_drawable_t win, xcb_get_property_cookie_t cookie)
 {
     xcb_get_property_reply_t *reply;
-    xcb_get_property_cookie_t cookie;
     uint32_t *wsp;
     uint32_t ws;
 
-    cookie = xcb_get_property(conn, false, win, atom_desktop,
-                              XCB_GET_PROPERTY_TYPE_ANY, 0,
-                              sizeof (int32_t));
-
     reply = xcb_get_property_reply(conn, cookie, NULL);
     if (NULL == reply)
     {
@@ -573,23 +1034,20 @@ bad:
     return MCWM_NOWS;
 }
 
-/* Add a window, specified by client, to workspace ws. */
+/*
+ * Add a window, specified by client, to workspace ws. A window can be
+ * on several workspaces.
+ */
 void addtoworkspace(struct client *client, uint32_t ws)
 {
-    struct item *item;
-
-    item = additem(&wslist[ws]);
-    if (NULL == item)
+    if (client->wsmask & WSBIT(ws))
     {
-        PDEBUG("addtoworkspace: Out of memory.\n");
         return;
     }
 
-    /* Remember our place in the workspace window list. */
-    client->wsitem[ws] = item;
-
-    /* Remember the data. */
-    item->data = client;
+    client->wsmask |= WSBIT(ws);
+    ILIST_INSERT_HEAD(&wslist[ws], client, wslink[ws]);
+    geomgen ++;
 
     /*
      * Set window hint property so we can survive a crash.
@@ -606,111 +1064,319 @@ void addtoworkspace(struct client *client, uint32_t ws)
 /* Delete window client from workspace ws. */
 void delfromworkspace(struct client *client, uint32_t ws)
 {
-    delitem(&wslist[ws], client->wsitem[ws]);
+    if (!(client->wsmask & WSBIT(ws)))
+    {
+        return;
+    }
 
-    /* Reset our place in the workspace window list. */
-    client->wsitem[ws] = NULL;
+    client->wsmask &= ~WSBIT(ws);
+    ILIST_REMOVE(&wslist[ws], client, wslink[ws]);
+    geomgen ++;
 }
 
-/* Change current workspace to ws. */
-void changeworkspace(uint32_t ws)
+/* Delete window client from all workspaces it's on. */
+void delfromworkspaces(struct client *client)
 {
-    struct item *item;
-    struct client *client;
+    uint32_t ws;
 
-    if (ws == curws)
+    for (ws = 0; 0 != client->wsmask; ws ++)
     {
-        PDEBUG("Changing to same workspace!\n");
-        return;
+        delfromworkspace(client, ws);
     }
+}
 
-    PDEBUG("Changing from workspace #%d to #%d\n", curws, ws);
+/* Is client visible on workspace ws? */
+bool onworkspace(struct client *client, uint32_t ws)
+{
+    return client->fixed || (client->wsmask & WSBIT(ws));
+}
 
-    /*
-     * We lose our focus if the window we focus isn't fixed. An
-     * EnterNotify event will set focus later.
-     */
-    if (NULL != focuswin && !focuswin->fixed)
+/*
+ * Windows on workspace ws are the ones on its own list followed by
+ * the fixed windows. These walk both lists as if they were one.
+ */
+struct client *wsfirst(uint32_t ws)
+{
+    if (!ILIST_EMPTY(&wslist[ws]))
     {
-        setunfocus(focuswin->id);
-        focuswin = NULL;
+        return ILIST_FIRST(&wslist[ws]);
     }
 
-    /* Go through list of current ws. Unmap everything that isn't fixed. */
-    for (item = wslist[curws]; item != NULL; item = item->next)
+    return ILIST_FIRST(&stickylist);
+}
+
+struct client *wslast(uint32_t ws)
+{
+    if (!ILIST_EMPTY(&stickylist))
     {
-        client = item->data;
+        return ILIST_LAST(&stickylist);
+    }
 
-        PDEBUG("changeworkspace. unmap phase. ws #%d, client-fixed: %d\n",
-               curws, client->fixed);
+    return ILIST_LAST(&wslist[ws]);
+}
 
-        if (!client->fixed)
-        {
-            /*
-             * This is an ordinary window. Just unmap it. Note that
-             * this will generate an unnecessary UnmapNotify event
-             * which we will try to handle later.
-             */
-            xcb_unmap_window(conn, client->id);
-        }
+struct client *wsnext(struct client *client, uint32_t ws)
+{
+    if (client->fixed)
+    {
+        return ILIST_NEXT(client, stickylink);
     }
 
-    /* Go through list of new ws. Map everything that isn't fixed. */
-    for (item = wslist[ws]; item != NULL; item = item->next)
+    if (NULL != ILIST_NEXT(client, wslink[ws]))
     {
-        client = item->data;
+        return ILIST_NEXT(client, wslink[ws]);
+    }
 
-        PDEBUG("changeworkspace. map phase. ws #%d, client-fixed: %d\n",
-               ws, client->fixed);
+    return ILIST_FIRST(&stickylist);
+}
 
-        /* Fixed windows are already mapped. Map everything else. */
-        if (!client->fixed)
-        {
-            xcb_map_window(conn, client->id);
-        }
+struct client *wsprev(struct client *client, uint32_t ws)
+{
+    if (!client->fixed)
+    {
+        return ILIST_PREV(client, wslink[ws]);
     }
 
-    xcb_flush(conn);
+    if (NULL != ILIST_PREV(client, stickylink))
+    {
+        return ILIST_PREV(client, stickylink);
+    }
 
-    curws = ws;
+    return ILIST_LAST(&wslist[ws]);
 }
 
-/*
- * Fix or unfix a window client from all workspaces. If setcolour is
- * set, also change back to ordinary focus colour when unfixing.
- */
-void fixwindow(struct client *client, bool setcolour)
+/* Change current workspace to ws. */
+void changeworkspace(uint32_t ws)
 {
-    uint32_t values[1];
-    uint32_t ws;
+    struct client *client;
+    xcb_query_tree_reply_t *reply;
+    xcb_window_t *children;
+    int len;
+    int i;
+#if DEBUG
+    int64_t start = monotime();
+    unsigned nmapped = 0;
+#endif
 
-    if (NULL == client)
+    if (ws == curws)
     {
+        PDEBUG("Changing to same workspace!\n");
         return;
     }
 
-    if (client->fixed)
+    if (ws >= conf.workspaces)
     {
-        client->fixed = false;
-        setwmdesktop(client->id, curws);
+        PDEBUG("No workspace #%d.\n", ws);
+        return;
+    }
 
-        if (setcolour)
-        {
-            /* Set border color to ordinary focus colour. */
-            values[0] = conf.focuscol;
-            xcb_change_window_attributes(conn, client->id, XCB_CW_BORDER_PIXEL,
-                                         values);
+    PDEBUG("Changing from workspace #%d to #%d\n", curws, ws);
+
+    geomgen ++;
+
+    /*
+     * We lose our focus if the window we focus isn't on the new
+     * workspace as well. An EnterNotify event will set focus later.
+     */
+    if (NULL != focuswin && !onworkspace(focuswin, ws))
+    {
+        setunfocus(focuswin->id);
+        focuswin = NULL;
+    }
+
+    /*
+     * Do the whole switch while nobody else can talk to the server,
+     * so it never shows a half empty workspace and repaints only
+     * once.
+     */
+    xcb_grab_server(conn);
+
+    /* Stacking order, bottom window first. Can't change while grabbed. */
+    reply = xcb_query_tree_reply(conn, xcb_query_tree(conn, screen->root),
+                                 0);
+
+    /*
+     * Hide everything on the current workspace that isn't on the new
+     * one. Fixed windows aren't on the list.
+     */
+    ILIST_FOREACH(client, &wslist[curws], wslink[curws])
+    {
+        if (!(client->wsmask & WSBIT(ws)))
+        {
+            hidefromws(client);
         }
+    }
+
+    /*
+     * Map everything on the new workspace that wasn't on the old.
+     * Fixed windows are already mapped.
+     *
+     * Map from the top of the stack down. Then windows further down
+     * are already partly covered when they appear and get less to
+     * expose.
+     */
+    if (NULL != reply)
+    {
+        len = xcb_query_tree_children_length(reply);
+        children = xcb_query_tree_children(reply);
 
-        /* Delete from all workspace lists except current. */
-        for (ws = 0; ws < WORKSPACES; ws ++)
+        for (i = len - 1; i >= 0; i --)
         {
-            if (ws != curws)
+            client = findclient(children[i]);
+            if (NULL != client
+                && (client->wsmask & WSBIT(ws))
+                && !(client->wsmask & WSBIT(curws)))
+            {
+                if (client->parked)
+                {
+                    unpark(client);
+                }
+                else
+                {
+                    xcb_map_window(conn, client->id);
+#if DEBUG
+                    nmapped ++;
+#endif
+                }
+            }
+        }
+
+        free(reply);
+    }
+    else
+    {
+        /* We don't know the stacking order. Map in any order. */
+        ILIST_FOREACH(client, &wslist[ws], wslink[ws])
+        {
+            if (client->wsmask & WSBIT(curws))
+            {
+                continue;
+            }
+
+            if (client->parked)
+            {
+                unpark(client);
+            }
+            else
             {
-                delfromworkspace(client, ws);
+                xcb_map_window(conn, client->id);
+#if DEBUG
+                nmapped ++;
+#endif
             }
         }
     }
+
+    /* Move parked windows while we still hold the grab. */
+    commitgeom();
+
+    xcb_ungrab_server(conn);
+    xcb_flush(conn);
+
+    curws = ws;
+
+#if DEBUG
+    /*
+     * Wait for the server to finish so we time the whole switch.
+     * scripts/wsbench reads this.
+     */
+    free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+    PDEBUG("Switched workspace, %u windows mapped in %lld us.\n", nmapped,
+           (long long) (monotime() - start));
+#endif
+}
+
+/* Hide client because we're leaving its workspace. */
+void hidefromws(struct client *client)
+{
+    if (conf.parkwindows)
+    {
+        park(client);
+    }
+    else
+    {
+        unmapwin(client);
+    }
+}
+
+/*
+ * Unmap client. Remember the request so we know the UnmapNotify it
+ * causes is ours and not the client withdrawing its window.
+ */
+void unmapwin(struct client *client)
+{
+    client->unmapseq = xcb_unmap_window(conn, client->id).sequence;
+}
+
+/*
+ * Hide client by moving it off screen but keep it mapped. Clients
+ * don't throw away what they have drawn and showing them again is
+ * just a move.
+ *
+ * Like windows unmapped because they're on another workspace, it
+ * stays in NormalState. Only windows the user iconified are iconic.
+ */
+void park(struct client *client)
+{
+    if (client->parked)
+    {
+        return;
+    }
+
+    client->parked = true;
+    updategeom(client);
+}
+
+/* Move a parked client back where it belongs. */
+void unpark(struct client *client)
+{
+    if (!client->parked)
+    {
+        return;
+    }
+
+    client->parked = false;
+    updategeom(client);
+}
+
+/* Set the ICCCM WM_STATE of window win to state. */
+void setwmstate(xcb_drawable_t win, uint32_t state)
+{
+    uint32_t data[] = { state, XCB_NONE };
+
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win,
+                        wm_state, wm_state, 32, 2, data);
+}
+
+/*
+ * Fix or unfix a window client from all workspaces. If setcolour is
+ * set, also change back to ordinary focus colour when unfixing.
+ */
+void fixwindow(struct client *client, bool setcolour)
+{
+    uint32_t values[1];
+
+    if (NULL == client)
+    {
+        return;
+    }
+
+    if (client->fixed)
+    {
+        /* Keep it on the current workspace only. */
+        ILIST_REMOVE(&stickylist, client, stickylink);
+        client->fixed = false;
+        addtoworkspace(client, curws);
+
+        if (setcolour)
+        {
+            /* Set border color to ordinary focus colour. */
+            values[0] = conf.focuscol;
+            xcb_change_window_attributes(conn, client->id, XCB_CW_BORDER_PIXEL,
+                                         values);
+        }
+
+    }
     else
     {
         /*
@@ -720,18 +1386,13 @@ void fixwindow(struct client *client, bool setcolour)
          */
         raisewindow(client->id);
 
+        /* Move it from its workspaces to the fixed windows. */
+        delfromworkspaces(client);
         client->fixed = true;
+        ILIST_INSERT_HEAD(&stickylist, client, stickylink);
+        geomgen ++;
         setwmdesktop(client->id, NET_WM_FIXED);
 
-        /* Add window to all workspace lists. */
-        for (ws = 0; ws < WORKSPACES; ws ++)
-        {
-            if (ws != curws)
-            {
-                addtoworkspace(client, ws);
-            }
-        }
-
         if (setcolour)
         {
             /* Set border color to fixed colour. */
@@ -740,42 +1401,155 @@ void fixwindow(struct client *client, bool setcolour)
                                          values);
         }
     }
-
-    xcb_flush(conn);
 }
 
 /*
- * Get the pixel values of a named colour colstr.
- *
- * Returns pixel values.
- * */
-uint32_t getcolor(const char *colstr)
+ * Start looking up the pixel value of colour col. Hex colours on
+ * TrueColor screens don't need the X server, so they're done at
+ * once. Get the pixel value with getcolour().
+ */
+void askcolour(struct colour *col)
+{
+    xcb_visualtype_t *visual;
+    uint16_t rgb[3];
+    uint32_t masks[3];
+    uint32_t mask;
+    int shift;
+    int i;
+
+    visual = findvisual(screen->root_visual);
+    if (NULL != visual && XCB_VISUAL_CLASS_TRUE_COLOR == visual->_class
+        && parsehex(col->name, rgb))
+    {
+        masks[0] = visual->red_mask;
+        masks[1] = visual->green_mask;
+        masks[2] = visual->blue_mask;
+
+        *col->pixel = 0;
+        for (i = 0; i < 3; i ++)
+        {
+            if (0 == masks[i])
+            {
+                continue;
+            }
+
+            /* Scale the 16 bit value to the bits in the mask. */
+            for (shift = 0; !(masks[i] & (1U << shift)); shift ++)
+                ;
+            mask = masks[i] >> shift;
+            *col->pixel |= (uint32_t) ((uint64_t) rgb[i] * mask / 0xffff)
+                << shift;
+        }
+
+        PDEBUG("Colour %s is pixel %x.\n", col->name, *col->pixel);
+
+        col->pending = false;
+        return;
+    }
+
+    col->cookie = xcb_alloc_named_color(conn, screen->default_colormap,
+                                        strlen(col->name), col->name);
+    col->pending = true;
+}
+
+/* Get the pixel value of colour col asked for with askcolour(). */
+void getcolour(struct colour *col)
 {
     xcb_alloc_named_color_reply_t *col_reply;
-    xcb_colormap_t colormap;
     xcb_generic_error_t *error;
-    xcb_alloc_named_color_cookie_t colcookie;
 
-    colormap = screen->default_colormap;
-    colcookie = xcb_alloc_named_color(conn, colormap, strlen(colstr), colstr);
-    col_reply = xcb_alloc_named_color_reply(conn, colcookie, &error);
-    if (NULL != error)
+    if (!col->pending)
+    {
+        return;
+    }
+
+    col_reply = xcb_alloc_named_color_reply(conn, col->cookie, &error);
+    if (NULL != error || NULL == col_reply)
     {
         fprintf(stderr, "mcwm: Couldn't get pixel value for colour %s. "
-                "Exiting.\n", colstr);
+                "Exiting.\n", col->name);
 
         xcb_disconnect(conn);
         exit(1);
     }
 
-    return col_reply->pixel;
+    *col->pixel = col_reply->pixel;
+    col->pending = false;
+
+    free(col_reply);
+}
+
+/*
+ * Parse a hex colour, #RGB, #RRGGBB, #RRRGGGBBB or #RRRRGGGGBBBB,
+ * into 16 bit red, green and blue in rgb.
+ *
+ * Returns true if str was a hex colour.
+ */
+bool parsehex(const char *str, uint16_t rgb[3])
+{
+    size_t len;
+    size_t digits;
+    size_t i;
+    unsigned long value;
+    unsigned long max;
+    char part[5];
+
+    if ('#' != str[0])
+    {
+        return false;
+    }
+
+    len = strlen(str + 1);
+    if (0 == len || len > 12 || 0 != len % 3)
+    {
+        return false;
+    }
+
+    digits = len / 3;
+    max = (1UL << (digits * 4)) - 1;
+
+    for (i = 0; i < 3; i ++)
+    {
+        memcpy(part, str + 1 + i * digits, digits);
+        part[digits] = '\0';
+
+        if (strspn(part, "0123456789abcdefABCDEF") != digits)
+        {
+            return false;
+        }
+
+        value = strtoul(part, NULL, 16);
+        rgb[i] = value * 0xffff / max;
+    }
+
+    return true;
+}
+
+/* Find the visual with ID id on our screen. Returns NULL if none. */
+xcb_visualtype_t *findvisual(xcb_visualid_t id)
+{
+    xcb_depth_iterator_t depths;
+    xcb_visualtype_iterator_t visuals;
+
+    for (depths = xcb_screen_allowed_depths_iterator(screen); depths.rem;
+         xcb_depth_next(&depths))
+    {
+        for (visuals = xcb_depth_visuals_iterator(depths.data); visuals.rem;
+             xcb_visualtype_next(&visuals))
+        {
+            if (id == visuals.data->visual_id)
+            {
+                return visuals.data;
+            }
+        }
+    }
+
+    return NULL;
 }
 
 /* Forget everything about client client. */
 void forgetclient(struct client *client)
 {
-    uint32_t ws;
-
     if (NULL == client)
     {
         PDEBUG("forgetclient: client was NULL\n");
@@ -787,68 +1561,49 @@ void forgetclient(struct client *client)
      * Note that it's OK to be on several workspaces at once even if
      * you're not fixed.
      */
-    for (ws = 0; ws < WORKSPACES; ws ++)
+    if (client->fixed)
     {
-        if (NULL != client->wsitem[ws])
-        {
-            delfromworkspace(client, ws);
-        }
+        ILIST_REMOVE(&stickylist, client, stickylink);
+        geomgen ++;
+    }
+    delfromworkspaces(client);
+
+    /* Remove from window index and global window list. */
+    hashdel(&winhash, client->id);
+    ILIST_REMOVE(&winlist, client, winlink);
+
+    setmonitor(client, NULL);
+
+    if (ILIST_LINKED(&dirtylist, client, dirtylink))
+    {
+        ILIST_REMOVE(&dirtylist, client, dirtylink);
     }
 
-    /* Remove from global window list. */
-    freeitem(&winlist, NULL, client->winitem);
+    poolput(&clientpool, client);
 }
 
 /* Forget everything about a client with client->id win. */
 void forgetwin(xcb_window_t win)
 {
-    struct item *item;
     struct client *client;
-    uint32_t ws;
 
-    /* Find this window in the global window list. */
-    for (item = winlist; item != NULL; item = item->next)
+    /*
+     * Forget about it completely and free allocated data.
+     *
+     * Note that it might already be freed by handling an
+     * UnmapNotify, so it isn't necessarily an error if we don't find
+     * it.
+     */
+    client = findclient(win);
+    if (NULL == client)
     {
-        client = item->data;
-
-        /*
-         * Forget about it completely and free allocated data.
-         *
-         * Note that it might already be freed by handling an
-         * UnmapNotify, so it isn't necessarily an error if we don't
-         * find it.
-         */
-        PDEBUG("Win %d == client ID %d\n", win, client->id);
-        if (win == client->id)
-        {
-            /* Found it. */
-            PDEBUG("Found it. Forgetting...\n");
-
-            /*
-             * Delete window from whatever workspace lists it belonged
-             * to. Note that it's OK to be on several workspaces at
-             * once.
-             */
-            for (ws = 0; ws < WORKSPACES; ws ++)
-            {
-                PDEBUG("Looking in ws #%d.\n", ws);
-                if (NULL == client->wsitem[ws])
-                {
-                    PDEBUG("  but it wasn't there.\n");
-                }
-                else
-                {
-                    PDEBUG("  found it here. Deleting!\n");
-                    delfromworkspace(client, ws);
-                }
-            }
+        PDEBUG("forgetwin: Window %d not known.\n", win);
+        return;
+    }
 
-            free(item->data);
-            delitem(&winlist, item);
+    PDEBUG("Found it. Forgetting...\n");
 
-            return;
-        }
-    }
+    forgetclient(client);
 }
 
 /*
@@ -964,16 +1719,11 @@ void fitonscreen(struct client *client)
         willmove = true;
     }
 
-    if (willmove)
-    {
-        PDEBUG("Moving to %d,%d.\n", client->x, client->y);
-        movewindow(client->id, client->x, client->y);
-    }
-
-    if (willresize)
+    if (willmove || willresize)
     {
-        PDEBUG("Resizing to %d x %d.\n", client->width, client->height);
-        resize(client->id, client->width, client->height);
+        PDEBUG("Moving to %d,%d, resizing to %d x %d.\n", client->x,
+               client->y, client->width, client->height);
+        updategeom(client);
     }
 }
 
@@ -984,6 +1734,9 @@ void fitonscreen(struct client *client)
 void newwin(xcb_window_t win)
 {
     struct client *client;
+    struct wincookies cookies;
+    xcb_query_pointer_cookie_t pcookie;
+    xcb_query_pointer_reply_t *pointer;
 
     if (NULL != findclient(win))
     {
@@ -996,14 +1749,24 @@ void newwin(xcb_window_t win)
         return;
     }
 
+    /*
+     * Ask for everything we need to know before waiting for any of
+     * it: geometry and hints of the window and where the pointer is,
+     * in case we have to place the window ourselves. This way all the
+     * replies arrive in a single round trip.
+     */
+    getwininfo(win, &cookies);
+    pcookie = xcb_query_pointer(conn, screen->root);
+
     /*
      * Set up stuff, like borders, add the window to the client list,
      * et cetera.
      */
-    client = setupwin(win);
+    client = setupwin(win, &cookies);
     if (NULL == client)
     {
         fprintf(stderr, "mcwm: Couldn't set up window. Out of memory.\n");
+        xcb_discard_reply(conn, pcookie.sequence);
         return;
     }
 
@@ -1016,33 +1779,36 @@ void newwin(xcb_window_t win)
      */
     if (!client->usercoord)
     {
-        int16_t pointx;
-        int16_t pointy;
-        PDEBUG("Coordinates not set by user. Using pointer: %d,%d.\n",
-               pointx, pointy);
-
         /* Get pointer position so we can move the window to the cursor. */
-        if (!getpointer(screen->root, &pointx, &pointy))
+        pointer = xcb_query_pointer_reply(conn, pcookie, NULL);
+        if (NULL == pointer)
         {
             PDEBUG("Failed to get pointer coords!\n");
-            pointx = 0;
-            pointy = 0;
+            client->x = 0;
+            client->y = 0;
+        }
+        else
+        {
+            client->x = pointer->root_x;
+            client->y = pointer->root_y;
+            free(pointer);
         }
 
-        client->x = pointx;
-        client->y = pointy;
+        PDEBUG("Coordinates not set by user. Using pointer: %d,%d.\n",
+               client->x, client->y);
 
-        movewindow(client->id, client->x, client->y);
+        updategeom(client);
     }
     else
     {
         PDEBUG("User set coordinates.\n");
+        xcb_discard_reply(conn, pcookie.sequence);
     }
 
     /* Find the physical output this window will be on if RANDR is active. */
     if (-1 != randrbase)
     {
-        client->monitor = findmonbycoord(client->x, client->y);
+        setmonitor(client, findmonbycoord(client->x, client->y));
         if (NULL == client->monitor)
         {
             /*
@@ -1051,40 +1817,52 @@ void newwin(xcb_window_t win)
              */
             if (NULL != monlist)
             {
-                client->monitor = monlist->data;
+                setmonitor(client, monlist->data);
             }
         }
     }
 
     fitonscreen(client);
 
+    /* Don't show the window until it's where it should be. */
+    sendgeom(client);
+
     /* Show window on screen. */
     xcb_map_window(conn, client->id);
 
     /* Declare window normal. */
-    long data[] = { XCB_ICCCM_WM_STATE_NORMAL, XCB_NONE };
-    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, client->id,
-                        wm_state, wm_state, 32, 2, data);
+    setwmstate(client->id, XCB_ICCCM_WM_STATE_NORMAL);
 
     /*
      * Move cursor into the middle of the window so we don't lose the
      * pointer to another window.
      */
-    xcb_warp_pointer(conn, XCB_NONE, win, 0, 0, 0, 0,
-                     client->width / 2, client->height / 2);
+    warppointer(client, client->width / 2, client->height / 2);
+}
 
-    xcb_flush(conn);
+/*
+ * Ask the X server about everything we need to know before we can
+ * manage window win. Nothing waits for the replies here, so many
+ * windows can be asked about at once. Hand cookies to setupwin() to
+ * collect the answers.
+ */
+void getwininfo(xcb_window_t win, struct wincookies *cookies)
+{
+    cookies->geom = xcb_get_geometry(conn, win);
+    cookies->hints = xcb_icccm_get_wm_normal_hints_unchecked(conn, win);
 }
 
-/* Set border colour, width and event mask for window. */
-struct client *setupwin(xcb_window_t win)
+/*
+ * Set border colour, width and event mask for window. cookies are the
+ * pending requests from getwininfo().
+ */
+struct client *setupwin(xcb_window_t win, struct wincookies *cookies)
 {
     uint32_t mask = 0;
     uint32_t values[2];
-    struct item *item;
     struct client *client;
+    xcb_get_geometry_reply_t *geom;
     xcb_size_hints_t hints;
-    uint32_t ws;
 
     /* Set default border color. */
     values[0] = conf.unfocuscol;
@@ -1101,26 +1879,23 @@ struct client *setupwin(xcb_window_t win)
      */
     xcb_change_save_set(conn, XCB_SET_MODE_INSERT, win);
 
-    xcb_flush(conn);
-
     /* Remember window and store a few things about it. */
 
-    item = additem(&winlist);
-
-    if (NULL == item)
+    client = poolget(&clientpool);
+    if (NULL == client)
     {
         PDEBUG("newwin: Out of memory.\n");
-        return NULL;
+        goto nomem;
     }
 
-    client = malloc(sizeof (struct client));
-    if (NULL == client)
+    if (-1 == hashadd(&winhash, win, client))
     {
         PDEBUG("newwin: Out of memory.\n");
-        return NULL;
+        poolput(&clientpool, client);
+        goto nomem;
     }
 
-    item->data = client;
+    ILIST_INSERT_HEAD(&winlist, client, winlink);
 
     /* Initialize client. */
     client->id = win;
@@ -1140,34 +1915,51 @@ struct client *setupwin(xcb_window_t win)
     client->vertmaxed = false;
     client->maxed = false;
     client->fixed = false;
+    client->wsmask = 0;
+    client->parked = false;
+    client->unmapseq = 0;
     client->monitor = NULL;
-
-    client->winitem = item;
-
-    for (ws = 0; ws < WORKSPACES; ws ++)
-    {
-        client->wsitem[ws] = NULL;
-    }
+    client->monlink.prev = NULL;
+    client->monlink.next = NULL;
+    client->dirtylink.prev = NULL;
+    client->dirtylink.next = NULL;
+    client->stickylink.prev = NULL;
+    client->stickylink.next = NULL;
 
     PDEBUG("Adding window %d\n", client->id);
 
     setborders(client, conf.borderwidth);
 
     /* Get window geometry. */
-    if (!getgeom(client->id, &client->x, &client->y, &client->width,
-                 &client->height))
+    geom = xcb_get_geometry_reply(conn, cookies->geom, NULL);
+    if (NULL == geom)
     {
         fprintf(stderr, "Couldn't get geometry in initial setup of window.\n");
     }
+    else
+    {
+        client->x = geom->x;
+        client->y = geom->y;
+        client->width = geom->width;
+        client->height = geom->height;
+
+        free(geom);
+    }
+
+    /* This is what the X server thinks as well. */
+    client->sent.x = client->x;
+    client->sent.y = client->y;
+    client->sent.width = client->width;
+    client->sent.height = client->height;
 
     /*
      * Get the window's incremental size step, if any.
      */
-    if (!xcb_icccm_get_wm_normal_hints_reply(
-            conn, xcb_icccm_get_wm_normal_hints_unchecked(
-                conn, win), &hints, NULL))
+    if (!xcb_icccm_get_wm_normal_hints_reply(conn, cookies->hints, &hints,
+                                             NULL))
     {
         PDEBUG("Couldn't get size hints.\n");
+        hints.flags = 0;
     }
 
     /*
@@ -1208,12 +2000,19 @@ struct client *setupwin(xcb_window_t win)
     }
 
     return client;
+
+nomem:
+    /* Nobody is going to collect the replies. */
+    xcb_discard_reply(conn, cookies->geom.sequence);
+    xcb_discard_reply(conn, cookies->hints.sequence);
+
+    return NULL;
 }
 
 /*
  * Get a keycode from a keysym.
  *
- * Returns keycode value.
+ * Returns keycode value or 0 if keysym isn't on the keyboard.
  */
 xcb_keycode_t keysymtokeycode(xcb_keysym_t keysym, xcb_key_symbols_t *keysyms)
 {
@@ -1224,8 +2023,7 @@ xcb_keycode_t keysymtokeycode(xcb_keysym_t keysym, xcb_key_symbols_t *keysyms)
     keyp = xcb_key_symbols_get_keycode(keysyms, keysym);
     if (NULL == keyp)
     {
-        fprintf(stderr, "mcwm: Couldn't look up key. Exiting.\n");
-        exit(1);
+        fprintf(stderr, "mcwm: Couldn't look up key.\n");
         return 0;
     }
 
@@ -1236,59 +2034,76 @@ xcb_keycode_t keysymtokeycode(xcb_keysym_t keysym, xcb_key_symbols_t *keysyms)
 }
 
 /*
- * Set up all shortcut keys.
+ * Set up all shortcut keys from key symbols keysyms and the modifier
+ * mapping asked for with modcookie. Frees keysyms.
+ *
+ * Everything is worked out before anything is changed, so if we
+ * fail, the keys we had before still work.
  *
  * Returns 0 on success, non-zero otherwise.
  */
-int setupkeys(void)
+int setupkeys(xcb_key_symbols_t *keysyms,
+              xcb_get_modifier_mapping_cookie_t modcookie)
 {
-    xcb_key_symbols_t *keysyms;
+    xcb_get_modifier_mapping_reply_t *modmap;
+    xcb_keycode_t keycode;
+    xcb_keycode_t keycodes[KEY_MAX];
+    struct modkeycodes newmodkeys;
+    bool modifiers[256];
+    struct keyaction table[256][2];
+    uint8_t grabs[256];
+    uint16_t locks;
+    uint16_t oldlocks;
+    unsigned regrabbed = 0;
     unsigned i;
+    int shifted;
 
-    /* Get all the keysymbols. */
-    keysyms = xcb_key_symbols_alloc(conn);
+    memset(table, 0, sizeof table);
+    memset(grabs, 0, sizeof grabs);
 
     /*
      * Find out what keys generates our MODKEY mask. Unfortunately it
      * might be several keys.
      */
-    if (NULL != modkeys.keycodes)
+    modmap = xcb_get_modifier_mapping_reply(conn, modcookie, NULL);
+    if (NULL == modmap)
     {
-        free(modkeys.keycodes);
+        fprintf(stderr, "mcwm: Couldn't get the modifier mapping.\n");
+        xcb_key_symbols_free(keysyms);
+        return -1;
     }
-    modkeys = getmodkeys(MODKEY);
 
-    if (0 == modkeys.len)
+    newmodkeys = getmodkeys(modmap, MODKEY);
+
+    if (0 == newmodkeys.len)
     {
         fprintf(stderr, "We couldn't find any keycodes to our main modifier "
                 "key!\n");
+        free(newmodkeys.keycodes);
+        free(modmap);
+        xcb_key_symbols_free(keysyms);
         return -1;
     }
 
-    for (i = 0; i < modkeys.len; i ++)
-    {
-        /*
-         * Grab the keys that are bound to MODKEY mask with any other
-         * modifier.
-         */
-        xcb_grab_key(conn, 1, screen->root, XCB_MOD_MASK_ANY,
-                     modkeys.keycodes[i],
-                     XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
-    }
-
-    /* Now grab the rest of the keys with the MODKEY modifier. */
+    /*
+     * Grab our keys with the MODKEY modifier. The MODKEY keycodes
+     * themselves are only needed while tabbing. We grab the whole
+     * keyboard then.
+     */
     for (i = KEY_F; i < KEY_MAX; i ++)
     {
         if (XK_VoidSymbol == keys[i].keysym)
         {
-            keys[i].keycode = 0;
+            keycodes[i] = 0;
             continue;
         }
 
-        keys[i].keycode = keysymtokeycode(keys[i].keysym, keysyms);
-        if (0 == keys[i].keycode)
+        keycodes[i] = keysymtokeycode(keys[i].keysym, keysyms);
+        if (0 == keycodes[i])
         {
             /* Couldn't set up keys! */
+            free(newmodkeys.keycodes);
+            free(modmap);
 
             /* Get rid of key symbols. */
             xcb_key_symbols_free(keysyms);
@@ -1296,34 +2111,111 @@ int setupkeys(void)
             return -1;
         }
 
-        /* Grab other keys with a modifier mask. */
-        xcb_grab_key(conn, 1, screen->root, MODKEY, keys[i].keycode,
-                     XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+        keycode = keycodes[i];
 
-        /*
-         * XXX Also grab it's shifted counterpart. A bit ugly here
-         * because we grab all of them not just the ones we want.
-         */
-        xcb_grab_key(conn, 1, screen->root, MODKEY | SHIFTMOD,
-                     keys[i].keycode,
-                     XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+        /* If several keys have the same keycode, the first one wins. */
+        for (shifted = 0; shifted < 2; shifted ++)
+        {
+            if (NULL == table[keycode][shifted].fn)
+            {
+                table[keycode][shifted] = keyactions[i][shifted];
+            }
+        }
+
+        /* Grab only the modifier states the key is bound in. */
+        if (NULL != table[keycode][0].fn)
+        {
+            grabs[keycode] |= GRAB_PLAIN;
+        }
+
+        if (NULL != table[keycode][1].fn)
+        {
+            grabs[keycode] |= GRAB_SHIFTED;
+        }
     }
 
-    /* Need this to take effect NOW! */
-    xcb_flush(conn);
+    memset(modifiers, 0, sizeof modifiers);
+    locks = getmodifiers(modmap, keysyms, modifiers);
+    free(modmap);
 
     /* Get rid of the key symbols table. */
     xcb_key_symbols_free(keysyms);
 
+    /* Nothing can fail from here on. grabkey() needs the new locks. */
+    oldlocks = lockmask;
+    lockmask = locks;
+
+    /*
+     * Change the grabs of keycodes that need different grabs than
+     * before. If the lock modifiers moved, every grabbed key does.
+     */
+    for (i = 0; i < 256; i ++)
+    {
+        if (grabs[i] == keygrabs[i]
+            && (oldlocks == lockmask || 0 == grabs[i]))
+        {
+            continue;
+        }
+
+        if (0 != keygrabs[i])
+        {
+            xcb_ungrab_key(conn, i, screen->root, XCB_MOD_MASK_ANY);
+        }
+
+        if (grabs[i] & GRAB_PLAIN)
+        {
+            grabkey(i, MODKEY);
+        }
+
+        if (grabs[i] & GRAB_SHIFTED)
+        {
+            grabkey(i, MODKEY | SHIFTMOD);
+        }
+
+        regrabbed ++;
+    }
+
+    PDEBUG("Changed grabs on %u keycodes.\n", regrabbed);
+
+    for (i = KEY_F; i < KEY_MAX; i ++)
+    {
+        keys[i].keycode = keycodes[i];
+    }
+
+    free(modkeys.keycodes);
+    modkeys = newmodkeys;
+
+    memcpy(modifierkeys, modifiers, sizeof modifierkeys);
+    memcpy(keytable, table, sizeof keytable);
+    memcpy(keygrabs, grabs, sizeof keygrabs);
+
     return 0;
 }
 
+/* The keyboard mapping has settled after a change. Use it. */
+void keymaptimeout(void *arg)
+{
+    (void) arg;
+
+    /* Ask for the key symbols and the modifier mapping at once. */
+    if (0 != setupkeys(xcb_key_symbols_alloc(conn),
+                       xcb_get_modifier_mapping_unchecked(conn)))
+    {
+        fprintf(stderr, "mcwm: Couldn't set up keys after the keyboard "
+                "mapping changed.\n");
+    }
+}
+
 /*
  * Walk through all existing windows and set them up.
  *
+ * Requests for all windows are sent before we wait for any replies,
+ * so this costs a fixed number of round trips to the X server no
+ * matter how many windows there are.
+ *
  * Returns 0 on success.
  */
-int setupscreen(void)
+int setupscreen(xcb_query_tree_cookie_t treecookie)
 {
     xcb_query_tree_reply_t *reply;
     xcb_query_pointer_reply_t *pointer;
@@ -1331,12 +2223,14 @@ int setupscreen(void)
     int len;
     xcb_window_t *children;
     xcb_get_window_attributes_reply_t *attr;
+    struct adoption *adopt = NULL;
     struct client *client;
     uint32_t ws;
+    D(int managed = 0;)
+    D(int64_t starttime = monotime();)
 
     /* Get all children. */
-    reply = xcb_query_tree_reply(conn,
-                                 xcb_query_tree(conn, screen->root), 0);
+    reply = xcb_query_tree_reply(conn, treecookie, 0);
     if (NULL == reply)
     {
         return -1;
@@ -1345,12 +2239,28 @@ int setupscreen(void)
     len = xcb_query_tree_children_length(reply);
     children = xcb_query_tree_children(reply);
 
-    /* Set up all windows on this root. */
+    if (0 < len && NULL == (adopt = malloc(len * sizeof (struct adoption))))
+    {
+        fprintf(stderr, "mcwm: Out of memory.\n");
+        free(reply);
+        return -1;
+    }
+
+    /* Ask for the attributes of all windows. */
+    for (i = 0; i < len; i ++)
+    {
+        adopt[i].attr = xcb_get_window_attributes(conn, children[i]);
+    }
+
+    /*
+     * Find the windows we want to manage and ask for everything else
+     * we need to know about them.
+     */
     for (i = 0; i < len; i ++)
     {
-        attr = xcb_get_window_attributes_reply(
-            conn, xcb_get_window_attributes(conn, children[i]), NULL);
+        adopt[i].manage = false;
 
+        attr = xcb_get_window_attributes_reply(conn, adopt[i].attr, NULL);
         if (!attr)
         {
             fprintf(stderr, "Couldn't get attributes for window %d.",
@@ -1371,71 +2281,101 @@ int setupscreen(void)
         if (!attr->override_redirect
             && attr->map_state == XCB_MAP_STATE_VIEWABLE)
         {
-            client = setupwin(children[i]);
-            if (NULL != client)
-            {
-                /*
-                 * Find the physical output this window will be on if
-                 * RANDR is active.
-                 */
-                if (-1 != randrbase)
-                {
-                    PDEBUG("Looking for monitor on %d x %d.\n", client->x,
-                           client->y);
-                    client->monitor = findmonbycoord(client->x, client->y);
+            adopt[i].manage = true;
+
+            getwininfo(children[i], &adopt[i].win);
+
+            /*
+             * Check if this window has a workspace set already as a
+             * WM hint.
+             */
+            adopt[i].desktop = xcb_get_property(conn, false, children[i],
+                                                atom_desktop,
+                                                XCB_GET_PROPERTY_TYPE_ANY, 0,
+                                                sizeof (int32_t));
+        }
+
+        free(attr);
+    }
+
+    /* Set up all windows on this root. */
+    for (i = 0; i < len; i ++)
+    {
+        if (!adopt[i].manage)
+        {
+            continue;
+        }
+
+        client = setupwin(children[i], &adopt[i].win);
+        if (NULL == client)
+        {
+            xcb_discard_reply(conn, adopt[i].desktop.sequence);
+            continue;
+        }
+
+        D(managed ++);
+
+        /*
+         * Find the physical output this window will be on if RANDR is
+         * active.
+         */
+        if (-1 != randrbase)
+        {
+            PDEBUG("Looking for monitor on %d x %d.\n", client->x,
+                   client->y);
+            setmonitor(client, findmonbycoord(client->x, client->y));
 #if DEBUG
-                    if (NULL != client->monitor)
-                    {
-                        PDEBUG("Found client on monitor %s.\n",
-                               client->monitor->name);
-                    }
-                    else
-                    {
-                        PDEBUG("Couldn't find client on any monitor.\n");
-                    }
+            if (NULL != client->monitor)
+            {
+                PDEBUG("Found client on monitor %s.\n",
+                       client->monitor->name);
+            }
+            else
+            {
+                PDEBUG("Couldn't find client on any monitor.\n");
+            }
 #endif
-                }
+        }
 
-                /* Fit window on physical screen. */
-                fitonscreen(client);
+        /* Fit window on physical screen. */
+        fitonscreen(client);
 
-                /*
-                 * Check if this window has a workspace set already as
-                 * a WM hint.
-                 *
-                 */
-                ws = getwmdesktop(children[i]);
+        ws = getwmdesktop(children[i], adopt[i].desktop);
 
-                if (ws == NET_WM_FIXED)
-                {
-                    /* Add to current workspace. */
-                    addtoworkspace(client, curws);
-                    /* Add to all other workspaces. */
-                    fixwindow(client, false);
-                }
-                else if (MCWM_NOWS != ws && ws < WORKSPACES)
-                {
-                    addtoworkspace(client, ws);
-                    /* If it's not our current workspace, hide it. */
-                    if (ws != curws)
-                    {
-                        xcb_unmap_window(conn, client->id);
-                    }
-                }
-                else
-                {
-                    /*
-                     * No workspace hint at all. Just add it to our
-                     * current workspace.
-                     */
-                    addtoworkspace(client, curws);
-                }
+        if (ws == NET_WM_FIXED)
+        {
+            /* Add to current workspace. */
+            addtoworkspace(client, curws);
+            /* Add to all other workspaces. */
+            fixwindow(client, false);
+        }
+        else if (MCWM_NOWS != ws && ws < conf.workspaces)
+        {
+            addtoworkspace(client, ws);
+            /* If it's not our current workspace, hide it. */
+            if (ws != curws)
+            {
+                hidefromws(client);
             }
         }
-
-        free(attr);
+        else
+        {
+            /*
+             * No workspace hint at all. Just add it to our current
+             * workspace.
+             */
+            addtoworkspace(client, curws);
+        }
     }
 
+    PDEBUG("Set up %d of %d windows in %lld us.\n", managed, len,
+           (long long) (monotime() - starttime));
+
+    free(adopt);
+
+    /* Send whatever fitonscreen() did to the windows. */
+    commitgeom();
+
     changeworkspace(0);
 
     /*
@@ -1455,8 +2395,6 @@ int setupscreen(void)
         free(pointer);
     }
 
-    xcb_flush(conn);
-
     free(reply);
 
     return 0;
@@ -1486,13 +2424,10 @@ int setuprandr(void)
     PDEBUG("randrbase is %d.\n", base);
 
     xcb_randr_select_input(conn, screen->root,
-                           XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
                            XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE |
                            XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
                            XCB_RANDR_NOTIFY_MASK_OUTPUT_PROPERTY);
 
-    xcb_flush(conn);
-
     return base;
 }
 
@@ -1505,7 +2440,11 @@ void getrandr(void)
     xcb_randr_get_screen_resources_current_reply_t *res;
     xcb_randr_output_t *outputs;
     int len;
+    xcb_randr_crtc_t *crtcs;
+    int ncrtcs;
     xcb_timestamp_t timestamp;
+    xcb_randr_mode_info_t *modes;
+    int nmodes;
 
     rcookie = xcb_randr_get_screen_resources_current(conn, screen->root);
     res = xcb_randr_get_screen_resources_current_reply(conn, rcookie, NULL);
@@ -1519,27 +2458,61 @@ void getrandr(void)
     len = xcb_randr_get_screen_resources_current_outputs_length(res);
     outputs = xcb_randr_get_screen_resources_current_outputs(res);
 
+    ncrtcs = xcb_randr_get_screen_resources_current_crtcs_length(res);
+    crtcs = xcb_randr_get_screen_resources_current_crtcs(res);
+
+    nmodes = xcb_randr_get_screen_resources_current_modes_length(res);
+    modes = xcb_randr_get_screen_resources_current_modes(res);
+
     PDEBUG("Found %d outputs.\n", len);
 
-    /* Request information for all outputs. */
-    getoutputs(outputs, len, timestamp);
+    /*
+     * Request information for all outputs. Without outputs or CRTCs
+     * nothing is shown anywhere, so there are no monitors to find.
+     */
+    if (0 < len && 0 < ncrtcs)
+    {
+        getoutputs(outputs, len, crtcs, ncrtcs, timestamp, modes, nmodes);
+    }
+
+    /* Keep the modes around for randrtimeout(). */
+    free(randrres);
+    randrres = res;
+
+    if (-1 == buildmonmap())
+    {
+        fprintf(stderr, "mcwm: Out of memory.\n");
+    }
 
-    free(res);
+    fitmonitors();
 }
 
 /*
  * Walk through all the RANDR outputs (number of outputs == len) there
- * was at time timestamp.
+ * was at time timestamp. crtcs are the ncrtcs CRTCs they might be
+ * using and modes are the nmodes modes the CRTCs might be using.
+ * len and ncrtcs must not be 0.
+ *
+ * Information about all outputs and all CRTCs is requested before we
+ * wait for any of it, so this is one round trip to the X server no
+ * matter how many outputs there are.
  */
-void getoutputs(xcb_randr_output_t *outputs, int len, xcb_timestamp_t timestamp)
+void getoutputs(xcb_randr_output_t *outputs, int len,
+                xcb_randr_crtc_t *crtcs, int ncrtcs, xcb_timestamp_t timestamp,
+                xcb_randr_mode_info_t *modes, int nmodes)
 {
     char *name;
-    xcb_randr_get_crtc_info_cookie_t icookie;
-    xcb_randr_get_crtc_info_reply_t *crtc = NULL;
+    unsigned refresh;
+    xcb_randr_get_crtc_info_reply_t *crtc;
     xcb_randr_get_output_info_reply_t *output;
     struct monitor *mon;
     struct monitor *clonemon;
+    struct item *item;
     xcb_randr_get_output_info_cookie_t ocookie[len];
+    xcb_randr_get_output_info_reply_t *oreply[len];
+    xcb_randr_get_crtc_info_cookie_t ccookie[ncrtcs];
+    xcb_randr_get_crtc_info_reply_t *creply[ncrtcs];
+    struct hash crtchash = { 0 };   /* CRTC replies by CRTC ID. */
     int i;
 
     for (i = 0; i < len; i++)
@@ -1547,43 +2520,84 @@ void getoutputs(xcb_randr_output_t *outputs, int len, xcb_timestamp_t timestamp)
         ocookie[i] = xcb_randr_get_output_info(conn, outputs[i], timestamp);
     }
 
+    for (i = 0; i < ncrtcs; i ++)
+    {
+        ccookie[i] = xcb_randr_get_crtc_info(conn, crtcs[i], timestamp);
+    }
+
+    for (i = 0; i < ncrtcs; i ++)
+    {
+        creply[i] = xcb_randr_get_crtc_info_reply(conn, ccookie[i], NULL);
+        if (NULL != creply[i]
+            && -1 == hashadd(&crtchash, crtcs[i], creply[i]))
+        {
+            fprintf(stderr, "mcwm: Out of memory.\n");
+        }
+    }
+
+    /* We're about to find out what is cloned all over again. */
+    for (item = monlist; item != NULL; item = item->next)
+    {
+        mon = item->data;
+        mon->clones = false;
+    }
+
+    /*
+     * Outputs that aren't used at the moment can't be cloned. Mark
+     * them first so their clones take their place, whatever order the
+     * outputs come in. We forget about them when we're done.
+     */
+    for (i = 0; i < len; i ++)
+    {
+        oreply[i] = xcb_randr_get_output_info_reply(conn, ocookie[i], NULL);
+
+        if (NULL != oreply[i] && XCB_NONE == oreply[i]->crtc
+            && NULL != (mon = findmonitor(outputs[i])))
+        {
+            PDEBUG("Monitor %s not used at the moment.\n", mon->name);
+            mon->crtc = XCB_NONE;
+        }
+    }
+
     /* Loop through all outputs. */
     for (i = 0; i < len; i ++)
     {
-        output = xcb_randr_get_output_info_reply(conn, ocookie[i], NULL);
+        output = oreply[i];
 
         if (output == NULL)
         {
             continue;
         }
 
-        asprintf(&name, "%.*s",
-                 xcb_randr_get_output_info_name_length(output),
-                 xcb_randr_get_output_info_name(output));
-
-        PDEBUG("Name: %s\n", name);
-        PDEBUG("id: %d\n", outputs[i]);
+        PDEBUG("Output id: %d\n", outputs[i]);
         PDEBUG("Size: %d x %d mm.\n", output->mm_width, output->mm_height);
 
         if (XCB_NONE != output->crtc)
         {
-            icookie = xcb_randr_get_crtc_info(conn, output->crtc, timestamp);
-            crtc = xcb_randr_get_crtc_info_reply(conn, icookie, NULL);
+            crtc = hashfind(&crtchash, output->crtc);
             if (NULL == crtc)
             {
-                return;
+                PDEBUG("No information about CRTC %d.\n", output->crtc);
+                free(output);
+                continue;
             }
 
-            PDEBUG("CRTC: at %d, %d, size: %d x %d.\n", crtc->x, crtc->y,
-                   crtc->width, crtc->height);
+            refresh = moderefresh(modes, nmodes, crtc->mode);
+
+            PDEBUG("CRTC: at %d, %d, size: %d x %d, %u mHz.\n", crtc->x,
+                   crtc->y, crtc->width, crtc->height, refresh);
 
-            /* Check if it's a clone. */
+            /*
+             * Check if it's a clone of another monitor, that is, one
+             * at the same position.
+             */
             clonemon = findclones(outputs[i], crtc->x, crtc->y);
             if (NULL != clonemon)
             {
-                PDEBUG("Monitor %s, id %d is a clone of %s, id %d. Skipping.\n",
-                       name, outputs[i],
-                       clonemon->name, clonemon->id);
+                PDEBUG("Monitor id %d is a clone of %s, id %d. Skipping.\n",
+                       outputs[i], clonemon->name, clonemon->id);
+                clonemon->clones = true;
+                free(output);
                 continue;
             }
 
@@ -1591,18 +2605,38 @@ void getoutputs(xcb_randr_output_t *outputs, int len, xcb_timestamp_t timestamp)
             if (NULL == (mon = findmonitor(outputs[i])))
             {
                 PDEBUG("Monitor not known, adding to list.\n");
-                addmonitor(outputs[i], name, crtc->x, crtc->y, crtc->width,
-                           crtc->height);
+
+                asprintf(&name, "%.*s",
+                         xcb_randr_get_output_info_name_length(output),
+                         xcb_randr_get_output_info_name(output));
+
+                PDEBUG("Name: %s\n", name);
+
+                mon = addmonitor(outputs[i], name, crtc->x, crtc->y,
+                                 crtc->width, crtc->height, refresh);
+                if (NULL == mon)
+                {
+                    free(name);
+                }
+                else
+                {
+                    mon->crtc = output->crtc;
+                    mon->mode = crtc->mode;
+                }
             }
             else
             {
                 bool changed = false;
 
                 /*
-                 * We know this monitor. Update information. If it's
-                 * smaller than before, rearrange windows.
+                 * We know this monitor. Update information. If it
+                 * changed, rearrange windows when we're done.
                  */
-                PDEBUG("Known monitor. Updating info.\n");
+                PDEBUG("Known monitor %s. Updating info.\n", mon->name);
+
+                mon->crtc = output->crtc;
+                mon->mode = crtc->mode;
+                mon->refresh = refresh;
 
                 if (crtc->x != mon->x)
                 {
@@ -1628,90 +2662,551 @@ void getoutputs(xcb_randr_output_t *outputs, int len, xcb_timestamp_t timestamp)
 
                 if (changed)
                 {
-                    arrbymon(mon);
-                }
-            }
-
-            free(crtc);
-        }
-        else
-        {
-            PDEBUG("Monitor not used at the moment.\n");
-            /*
-             * Check if it was used before. If it was, do something.
-             */
-            if ((mon = findmonitor(outputs[i])))
-            {
-                struct item *item;
-                struct client *client;
-
-                /* Check all windows on this monitor and move them to
-                 * the next or to the first monitor if there is no
-                 * next.
-                 *
-                 * FIXME: Use per monitor workspace list instead of
-                 * global window list.
-                 */
-                for (item = winlist; item != NULL; item = item->next)
-                {
-                    client = item->data;
-                    if (client->monitor == mon)
-                    {
-                        if (NULL == client->monitor->item->next)
-                        {
-                            if (NULL == monlist)
-                            {
-                                client->monitor = NULL;
-                            }
-                            else
-                            {
-                                client->monitor = monlist->data;
-                            }
-                        }
-                        else
-                        {
-                            client->monitor =
-                                client->monitor->item->next->data;
-                        }
-
-                        fitonscreen(client);
-                    }
+                    mon->dirty = true;
                 }
-
-                /* It's not active anymore. Forget about it. */
-                delmonitor(mon);
             }
         }
 
         free(output);
     }
-}
 
-void arrbymon(struct monitor *monitor)
-{
-    struct item *item;
-    struct client *client;
+    dropmonitors();
 
-    PDEBUG("arrbymon\n");
-    /*
-     * Go through all windows on this monitor. If they don't fit on
-     * the new screen, move them around and resize them as necessary.
-     *
-     * FIXME: Use a per monitor workspace list instead of global
-     * windows list.
-     */
-    for (item = winlist; item != NULL; item = item->next)
+    for (i = 0; i < ncrtcs; i ++)
     {
-        client = item->data;
-        if (client->monitor == monitor)
-        {
-            fitonscreen(client);
-        }
+        free(creply[i]);
     }
 
+    hashfree(&crtchash);
 }
 
-struct monitor *findmonitor(xcb_randr_output_t id)
+/*
+ * Return the refresh rate in mHz of the mode with ID id among the
+ * nmodes modes in modes, or 0 if we can't tell.
+ */
+unsigned moderefresh(xcb_randr_mode_info_t *modes, int nmodes,
+                     xcb_randr_mode_t id)
+{
+    uint64_t dots;
+    uint64_t total;
+    int i;
+
+    for (i = 0; i < nmodes; i ++)
+    {
+        if (id != modes[i].id)
+        {
+            continue;
+        }
+
+        dots = (uint64_t) modes[i].dot_clock * 1000;
+        total = (uint64_t) modes[i].htotal * modes[i].vtotal;
+
+        /* Every line is drawn twice. */
+        if (modes[i].mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN)
+        {
+            total *= 2;
+        }
+
+        /* Every refresh is only half the lines. */
+        if (modes[i].mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE)
+        {
+            dots *= 2;
+        }
+
+        if (0 == total)
+        {
+            return 0;
+        }
+
+        return dots / total;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the refresh rate in mHz of mode id among the modes we know
+ * about, or 0 if we can't tell.
+ */
+unsigned refreshnow(xcb_randr_mode_t id)
+{
+    if (NULL == randrres)
+    {
+        return 0;
+    }
+
+    return moderefresh(
+        xcb_randr_get_screen_resources_current_modes(randrres),
+        xcb_randr_get_screen_resources_current_modes_length(randrres), id);
+}
+
+/*
+ * Remember a RANDR CRTC or output change until the configuration
+ * settles. A single xrandr command causes a burst of these.
+ */
+void randrnotify(xcb_randr_notify_event_t *e)
+{
+    struct randrchanges *ch = &randrchanges;
+    unsigned i;
+    void *new;
+
+    switch (e->subCode)
+    {
+    case XCB_RANDR_NOTIFY_CRTC_CHANGE:
+        PDEBUG("RANDR CRTC %d changed.\n", e->u.cc.crtc);
+
+        for (i = 0; i < ch->ncrtcs; i ++)
+        {
+            if (ch->crtcs[i].crtc == e->u.cc.crtc)
+            {
+                break;
+            }
+        }
+
+        if (i == ch->crtcsize)
+        {
+            ch->crtcsize = 0 == ch->crtcsize ? 4 : ch->crtcsize * 2;
+            new = realloc(ch->crtcs, ch->crtcsize * sizeof *ch->crtcs);
+            if (NULL == new)
+            {
+                fprintf(stderr, "mcwm: Out of memory.\n");
+                ch->crtcsize = i;
+                return;
+            }
+            ch->crtcs = new;
+        }
+
+        ch->crtcs[i] = e->u.cc;
+        if (i == ch->ncrtcs)
+        {
+            ch->ncrtcs ++;
+        }
+        break;
+
+    case XCB_RANDR_NOTIFY_OUTPUT_CHANGE:
+        PDEBUG("RANDR output %d changed.\n", e->u.oc.output);
+
+        for (i = 0; i < ch->noutputs; i ++)
+        {
+            if (ch->outputs[i].change.output == e->u.oc.output)
+            {
+                break;
+            }
+        }
+
+        if (i == ch->outputsize)
+        {
+            ch->outputsize = 0 == ch->outputsize ? 4 : ch->outputsize * 2;
+            new = realloc(ch->outputs, ch->outputsize * sizeof *ch->outputs);
+            if (NULL == new)
+            {
+                fprintf(stderr, "mcwm: Out of memory.\n");
+                ch->outputsize = i;
+                return;
+            }
+            ch->outputs = new;
+        }
+
+        ch->outputs[i].change = e->u.oc;
+        if (i == ch->noutputs)
+        {
+            ch->noutputs ++;
+        }
+
+        ch->timestamp = e->u.oc.config_timestamp;
+        break;
+
+    default:
+        return;
+    }
+
+    looparm(randrtimer, RANDR_SETTLE);
+}
+
+/*
+ * The RANDR configuration has settled after a change. Update our
+ * monitors from what the notifies told us.
+ *
+ * Only new outputs and outputs that moved to another CRTC need
+ * asking about. All of that is asked for before we wait for any of
+ * it, so this is at most one round trip to the X server. Windows are
+ * fitted once, when all monitors are up to date.
+ *
+ * Clones change without telling us through their outputs. When that
+ * might have happened, we ask about everything with getrandr().
+ */
+void randrtimeout(void *arg)
+{
+    struct randrchanges *ch = &randrchanges;
+    xcb_randr_output_change_t *oc;
+    xcb_randr_crtc_change_t *cc;
+    struct outputchange *change;
+    xcb_randr_get_screen_resources_current_cookie_t rcookie;
+    xcb_randr_get_screen_resources_current_reply_t *res;
+    xcb_randr_get_output_info_reply_t *output;
+    xcb_randr_get_crtc_info_reply_t *crtc;
+    struct monitor *mon;
+    struct item *item;
+    bool asked = false;
+    char *name;
+    unsigned i;
+
+    (void) arg;
+
+    PDEBUG("Applying %u CRTC and %u output changes.\n", ch->ncrtcs,
+           ch->noutputs);
+
+    if (randrunknown(ch))
+    {
+        PDEBUG("Clones changed. Asking about everything.\n");
+        ch->ncrtcs = 0;
+        ch->noutputs = 0;
+        getrandr();
+        return;
+    }
+
+    /* Ask about everything we don't know yet. */
+    for (i = 0; i < ch->noutputs; i ++)
+    {
+        change = &ch->outputs[i];
+        oc = &change->change;
+        mon = findmonitor(oc->output);
+
+        change->asked = XCB_NONE != oc->crtc
+            && XCB_RANDR_CONNECTION_CONNECTED == oc->connection
+            && (NULL == mon || mon->crtc != oc->crtc);
+
+        if (!change->asked)
+        {
+            continue;
+        }
+
+        if (NULL == mon)
+        {
+            change->ocookie = xcb_randr_get_output_info(conn, oc->output,
+                                                        ch->timestamp);
+        }
+        change->ccookie = xcb_randr_get_crtc_info(conn, oc->crtc,
+                                                  ch->timestamp);
+        asked = true;
+    }
+
+    /* The CRTCs might use modes we haven't heard of. */
+    for (i = 0; i < ch->ncrtcs && !asked; i ++)
+    {
+        if (XCB_NONE != ch->crtcs[i].mode
+            && 0 == refreshnow(ch->crtcs[i].mode))
+        {
+            asked = true;
+        }
+    }
+
+    if (asked)
+    {
+        rcookie = xcb_randr_get_screen_resources_current(conn,
+                                                         screen->root);
+    }
+
+    /*
+     * Outputs that are turned off or unplugged lose their CRTC. We
+     * forget about them when everything else is done.
+     */
+    for (i = 0; i < ch->noutputs; i ++)
+    {
+        oc = &ch->outputs[i].change;
+        if (NULL == (mon = findmonitor(oc->output)))
+        {
+            continue;
+        }
+
+        if (XCB_RANDR_CONNECTION_CONNECTED != oc->connection)
+        {
+            mon->crtc = XCB_NONE;
+        }
+        else
+        {
+            mon->crtc = oc->crtc;
+        }
+    }
+
+    /* Move and resize monitors on the CRTCs that changed. */
+    for (item = monlist; item != NULL; item = item->next)
+    {
+        mon = item->data;
+
+        for (i = 0; i < ch->ncrtcs; i ++)
+        {
+            cc = &ch->crtcs[i];
+            if (XCB_NONE == mon->crtc || cc->crtc != mon->crtc)
+            {
+                continue;
+            }
+
+            if (XCB_NONE == cc->mode)
+            {
+                mon->crtc = XCB_NONE;
+                break;
+            }
+
+            if (cc->x != mon->x || cc->y != mon->y
+                || cc->width != mon->width || cc->height != mon->height)
+            {
+                mon->x = cc->x;
+                mon->y = cc->y;
+                mon->width = cc->width;
+                mon->height = cc->height;
+                mon->dirty = true;
+            }
+
+            mon->mode = cc->mode;
+            mon->refresh = refreshnow(cc->mode);
+        }
+    }
+
+    if (asked)
+    {
+        res = xcb_randr_get_screen_resources_current_reply(conn, rcookie,
+                                                           NULL);
+        if (NULL != res)
+        {
+            free(randrres);
+            randrres = res;
+
+            for (item = monlist; item != NULL; item = item->next)
+            {
+                mon = item->data;
+                mon->refresh = refreshnow(mon->mode);
+            }
+        }
+    }
+
+    /* New outputs and outputs on another CRTC. */
+    for (i = 0; i < ch->noutputs; i ++)
+    {
+        change = &ch->outputs[i];
+        if (!change->asked)
+        {
+            continue;
+        }
+
+        oc = &change->change;
+        mon = findmonitor(oc->output);
+
+        output = NULL;
+        if (NULL == mon)
+        {
+            output = xcb_randr_get_output_info_reply(conn, change->ocookie,
+                                                     NULL);
+        }
+
+        crtc = xcb_randr_get_crtc_info_reply(conn, change->ccookie, NULL);
+
+        if (NULL == crtc || (NULL == mon && NULL == output))
+        {
+            PDEBUG("No information about output %d.\n", oc->output);
+        }
+        else if (NULL != mon)
+        {
+            if (crtc->x != mon->x || crtc->y != mon->y
+                || crtc->width != mon->width || crtc->height != mon->height)
+            {
+                mon->x = crtc->x;
+                mon->y = crtc->y;
+                mon->width = crtc->width;
+                mon->height = crtc->height;
+                mon->dirty = true;
+            }
+
+            mon->mode = crtc->mode;
+            mon->refresh = refreshnow(crtc->mode);
+        }
+        else
+        {
+            /* Is it a clone of a monitor we have? */
+            if (NULL != (mon = findclones(oc->output, crtc->x, crtc->y)))
+            {
+                PDEBUG("Output %d is a clone of %s. Skipping.\n",
+                       oc->output, mon->name);
+                mon->clones = true;
+            }
+            else
+            {
+                asprintf(&name, "%.*s",
+                         xcb_randr_get_output_info_name_length(output),
+                         xcb_randr_get_output_info_name(output));
+
+                PDEBUG("New monitor %s.\n", name);
+
+                mon = addmonitor(oc->output, name, crtc->x, crtc->y,
+                                 crtc->width, crtc->height,
+                                 refreshnow(crtc->mode));
+                if (NULL == mon)
+                {
+                    free(name);
+                }
+                else
+                {
+                    mon->crtc = oc->crtc;
+                    mon->mode = crtc->mode;
+                }
+            }
+        }
+
+        free(output);
+        free(crtc);
+    }
+
+    dropmonitors();
+
+    ch->ncrtcs = 0;
+    ch->noutputs = 0;
+
+    if (-1 == buildmonmap())
+    {
+        fprintf(stderr, "mcwm: Out of memory.\n");
+    }
+
+    /* Now fit the windows, once. */
+    fitmonitors();
+}
+
+/*
+ * Do the RANDR changes in ch involve clones we can't follow from the
+ * changes alone? That is, is a CRTC no monitor of ours uses turned on
+ * without an output telling us about it, as when a clone is moved
+ * away from what it cloned? Or does a monitor with clones stop being
+ * shown where it was, so one of its clones should take its place?
+ *
+ * Returns true if we need to ask about everything again.
+ */
+bool randrunknown(struct randrchanges *ch)
+{
+    xcb_randr_output_change_t *oc;
+    xcb_randr_crtc_change_t *cc;
+    struct monitor *mon;
+    unsigned i;
+    unsigned j;
+
+    for (i = 0; i < ch->ncrtcs; i ++)
+    {
+        cc = &ch->crtcs[i];
+        mon = findmonbycrtc(cc->crtc);
+
+        if (XCB_NONE == cc->mode)
+        {
+            if (NULL != mon && mon->clones)
+            {
+                return true;
+            }
+            continue;
+        }
+
+        if (NULL != mon)
+        {
+            if (mon->clones && (cc->x != mon->x || cc->y != mon->y))
+            {
+                return true;
+            }
+            continue;
+        }
+
+        /* Does an output tell us about this CRTC? */
+        for (j = 0; j < ch->noutputs; j ++)
+        {
+            if (ch->outputs[j].change.crtc == cc->crtc)
+            {
+                break;
+            }
+        }
+
+        if (j == ch->noutputs)
+        {
+            return true;
+        }
+    }
+
+    for (i = 0; i < ch->noutputs; i ++)
+    {
+        oc = &ch->outputs[i].change;
+        mon = findmonitor(oc->output);
+
+        if (NULL != mon && mon->clones
+            && (XCB_RANDR_CONNECTION_CONNECTED != oc->connection
+                || oc->crtc != mon->crtc))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Move all windows on monitor mon to a clone of it, or else to the
+ * next monitor that is still shown, or the first if there is no
+ * next, and forget about mon.
+ *
+ * The windows are fitted by fitmonitors() later. If there is no
+ * other monitor, they end up on none and are fitted to the root
+ * window here, since nothing else will.
+ */
+void dropmonitor(struct monitor *mon)
+{
+    struct client *client;
+    struct client *next;
+    struct monitor *newmon;
+    struct item *item;
+
+    /* A clone showing the same thing takes its place. */
+    newmon = findclones(mon->id, mon->x, mon->y);
+
+    for (item = mon->item->next; NULL == newmon && item != mon->item;
+         item = NULL != item ? item->next : monlist)
+    {
+        if (NULL != item && XCB_NONE != ((struct monitor *) item->data)->crtc)
+        {
+            newmon = item->data;
+            break;
+        }
+    }
+
+    ILIST_FOREACH_SAFE(client, &mon->clients, monlink, next)
+    {
+        setmonitor(client, newmon);
+        if (NULL == newmon)
+        {
+            fitonscreen(client);
+        }
+    }
+
+    if (NULL != newmon)
+    {
+        newmon->dirty = true;
+    }
+
+    delmonitor(mon);
+}
+
+/* Forget about all monitors that aren't shown anymore. */
+void dropmonitors(void)
+{
+    struct item *item;
+    struct item *next;
+    struct monitor *mon;
+
+    for (item = monlist; item != NULL; item = next)
+    {
+        next = item->next;
+        mon = item->data;
+        if (XCB_NONE == mon->crtc)
+        {
+            dropmonitor(mon);
+        }
+    }
+}
+
+/* Fit the windows on all monitors that changed. */
+void fitmonitors(void)
 {
     struct item *item;
     struct monitor *mon;
@@ -1719,17 +3214,57 @@ struct monitor *findmonitor(xcb_randr_output_t id)
     for (item = monlist; item != NULL; item = item->next)
     {
         mon = item->data;
-        if (id == mon->id)
+        if (mon->dirty)
+        {
+            arrbymon(mon);
+            mon->dirty = false;
+        }
+    }
+}
+
+void arrbymon(struct monitor *monitor)
+{
+    struct client *client;
+
+    PDEBUG("arrbymon\n");
+    /*
+     * Go through all windows on this monitor. If they don't fit on
+     * the new screen, move them around and resize them as necessary.
+     */
+    ILIST_FOREACH(client, &monitor->clients, monlink)
+    {
+        fitonscreen(client);
+    }
+}
+
+struct monitor *findmonitor(xcb_randr_output_t id)
+{
+    return hashfind(&monhash, id);
+}
+
+/* Find the monitor shown by CRTC crtc. */
+struct monitor *findmonbycrtc(xcb_randr_crtc_t crtc)
+{
+    struct monitor *mon;
+    struct item *item;
+
+    for (item = monlist; item != NULL; item = item->next)
+    {
+        mon = item->data;
+        if (XCB_NONE != crtc && crtc == mon->crtc)
         {
-            PDEBUG("findmonitor: Found it. Output ID: %d\n", mon->id);
             return mon;
         }
-        PDEBUG("findmonitor: Goint to %p.\n", item->next);
     }
 
     return NULL;
 }
 
+/*
+ * Find a monitor other than output id that is shown at x, y. An
+ * output there is a clone of it. Monitors we already have always win
+ * over new outputs.
+ */
 struct monitor *findclones(xcb_randr_output_t id, int16_t x, int16_t y)
 {
     struct monitor *clonemon;
@@ -1739,13 +3274,9 @@ struct monitor *findclones(xcb_randr_output_t id, int16_t x, int16_t y)
     {
         clonemon = item->data;
 
-        PDEBUG("Monitor %s: x, y: %d--%d, %d--%d.\n",
-               clonemon->name,
-               clonemon->x, clonemon->x + clonemon->width,
-               clonemon->y, clonemon->y + clonemon->height);
-
         /* Check for same position. */
-        if (id != clonemon->id && clonemon->x == x && clonemon->y == y)
+        if (id != clonemon->id && XCB_NONE != clonemon->crtc
+            && clonemon->x == x && clonemon->y == y)
         {
             return clonemon;
         }
@@ -1754,44 +3285,228 @@ struct monitor *findclones(xcb_randr_output_t id, int16_t x, int16_t y)
     return NULL;
 }
 
-struct monitor *findmonbycoord(int16_t x, int16_t y)
+/*
+ * Rebuild the monitor map from monlist. Call this every time
+ * monitors are added, removed or changed.
+ *
+ * Returns 0 on success, -1 if out of memory. The map is empty if we
+ * fail.
+ */
+int buildmonmap(void)
 {
     struct item *item;
     struct monitor *mon;
+    unsigned nmon = 0;
+    unsigned i;
+    unsigned j;
+    int32_t x;
+    int32_t y;
+
+    free(monmap.xs);
+    free(monmap.ys);
+    free(monmap.cells);
+    monmap.xs = NULL;
+    monmap.ys = NULL;
+    monmap.cells = NULL;
+    monmap.nx = 0;
+    monmap.ny = 0;
 
     for (item = monlist; item != NULL; item = item->next)
+    {
+        nmon ++;
+    }
+
+    if (0 == nmon)
+    {
+        return 0;
+    }
+
+    monmap.xs = malloc(2 * nmon * sizeof (int32_t));
+    monmap.ys = malloc(2 * nmon * sizeof (int32_t));
+    if (NULL == monmap.xs || NULL == monmap.ys)
+    {
+        goto nomem;
+    }
+
+    /*
+     * Monitors include their right and bottom edges, so cells end
+     * just after them.
+     */
+    for (i = 0, item = monlist; item != NULL; item = item->next)
     {
         mon = item->data;
 
-        PDEBUG("Monitor %s: x, y: %d--%d, %d--%d.\n",
-               mon->name,
-               mon->x, mon->x + mon->width,
-               mon->y, mon->y + mon->height);
+        monmap.xs[i] = mon->x;
+        monmap.ys[i ++] = mon->y;
+        monmap.xs[i] = mon->x + mon->width + 1;
+        monmap.ys[i ++] = mon->y + mon->height + 1;
+    }
 
-        PDEBUG("Is %d,%d between them?\n", x, y);
+    monmap.nx = addedges(monmap.xs, 2 * nmon);
+    monmap.ny = addedges(monmap.ys, 2 * nmon);
 
-        if (x >= mon->x && x <= mon->x + mon->width
-            && y >= mon->y && y <= mon->y + mon->height)
+    monmap.cells = malloc((monmap.nx - 1) * (monmap.ny - 1)
+                          * sizeof (struct monitor *));
+    if (NULL == monmap.cells)
+    {
+        goto nomem;
+    }
+
+    /* Give every cell the first monitor covering it, like before. */
+    for (j = 0; j < monmap.ny - 1; j ++)
+    {
+        for (i = 0; i < monmap.nx - 1; i ++)
         {
-            PDEBUG("findmonbycoord: Found it. Output ID: %d, name %s\n",
-                   mon->id, mon->name);
-            return mon;
+            x = monmap.xs[i];
+            y = monmap.ys[j];
+
+            monmap.cells[j * (monmap.nx - 1) + i] = NULL;
+
+            for (item = monlist; item != NULL; item = item->next)
+            {
+                mon = item->data;
+
+                if (x >= mon->x && x <= mon->x + mon->width
+                    && y >= mon->y && y <= mon->y + mon->height)
+                {
+                    monmap.cells[j * (monmap.nx - 1) + i] = mon;
+                    break;
+                }
+            }
         }
     }
 
-    return NULL;
+    return 0;
+
+nomem:
+    free(monmap.xs);
+    free(monmap.ys);
+    monmap.xs = NULL;
+    monmap.ys = NULL;
+    monmap.nx = 0;
+    monmap.ny = 0;
+
+    return -1;
+}
+
+/*
+ * Sort the n coordinates in edges and remove duplicates.
+ *
+ * Returns the number of coordinates left.
+ */
+unsigned addedges(int32_t *edges, unsigned n)
+{
+    unsigned i;
+    unsigned j;
+
+    qsort(edges, n, sizeof (int32_t), cmpedge);
+
+    for (i = 0, j = 1; j < n; j ++)
+    {
+        if (edges[j] != edges[i])
+        {
+            edges[++ i] = edges[j];
+        }
+    }
+
+    return i + 1;
+}
+
+int cmpedge(const void *a, const void *b)
+{
+    int32_t ea = *(const int32_t *) a;
+    int32_t eb = *(const int32_t *) b;
+
+    return (ea > eb) - (ea < eb);
+}
+
+/*
+ * Find the cell value is in among the n cell edges in edges.
+ *
+ * Returns the cell number or -1 if value is outside all cells.
+ */
+int findedge(const int32_t *edges, unsigned n, int32_t value)
+{
+    unsigned first = 0;
+    unsigned last = n;
+    unsigned mid;
+
+    /* Find the first edge after value. */
+    while (first < last)
+    {
+        mid = first + (last - first) / 2;
+        if (edges[mid] <= value)
+        {
+            first = mid + 1;
+        }
+        else
+        {
+            last = mid;
+        }
+    }
+
+    if (0 == first || n == first)
+    {
+        return -1;
+    }
+
+    return first - 1;
+}
+
+/*
+ * Find the monitor covering x,y.
+ *
+ * Returns the monitor or NULL if x,y isn't on any monitor.
+ */
+struct monitor *findmonbycoord(int16_t x, int16_t y)
+{
+    int i;
+    int j;
+
+    if ((i = findedge(monmap.xs, monmap.nx, x)) < 0
+        || (j = findedge(monmap.ys, monmap.ny, y)) < 0)
+    {
+        return NULL;
+    }
+
+    return monmap.cells[j * (monmap.nx - 1) + i];
+}
+
+/* Move client to monitor mon. */
+void setmonitor(struct client *client, struct monitor *mon)
+{
+    if (mon == client->monitor)
+    {
+        return;
+    }
+
+    PDEBUG("Window %d now on monitor %s.\n", client->id,
+           NULL == mon ? "none" : mon->name);
+
+    if (NULL != client->monitor)
+    {
+        ILIST_REMOVE(&client->monitor->clients, client, monlink);
+    }
+
+    if (NULL != mon)
+    {
+        ILIST_INSERT_TAIL(&mon->clients, client, monlink);
+    }
+
+    client->monitor = mon;
 }
 
 void delmonitor(struct monitor *mon)
 {
     PDEBUG("Deleting output %s.\n", mon->name);
+    hashdel(&monhash, mon->id);
     free(mon->name);
     freeitem(&monlist, NULL, mon->item);
 }
 
 struct monitor *addmonitor(xcb_randr_output_t id, char *name,
                            uint32_t x, uint32_t y, uint16_t width,
-                           uint16_t height)
+                           uint16_t height, unsigned refresh)
 {
     struct item *item;
     struct monitor *mon;
@@ -1803,9 +3518,11 @@ struct monitor *addmonitor(xcb_randr_output_t id, char *name,
     }
 
     mon = malloc(sizeof (struct monitor));
-    if (NULL == mon)
+    if (NULL == mon || -1 == hashadd(&monhash, id, mon))
     {
         fprintf(stderr, "Out of memory.\n");
+        free(mon);
+        delitem(&monlist, item);
         return NULL;
     }
 
@@ -1817,7 +3534,13 @@ struct monitor *addmonitor(xcb_randr_output_t id, char *name,
     mon->y = y;
     mon->width = width;
     mon->height = height;
+    mon->refresh = refresh;
     mon->item = item;
+    mon->crtc = XCB_NONE;
+    mon->mode = XCB_NONE;
+    mon->dirty = false;
+    mon->clones = false;
+    ILIST_INIT(&mon->clients);
 
     return mon;
 }
@@ -1835,7 +3558,6 @@ void raisewindow(xcb_drawable_t win)
     xcb_configure_window(conn, win,
                          XCB_CONFIG_WINDOW_STACK_MODE,
                          values);
-    xcb_flush(conn);
 }
 
 /*
@@ -1857,7 +3579,6 @@ void raiseorlower(struct client *client)
     xcb_configure_window(conn, win,
                          XCB_CONFIG_WINDOW_STACK_MODE,
                          values);
-    xcb_flush(conn);
 }
 
 void movelim(struct client *client)
@@ -1882,54 +3603,177 @@ void movelim(struct client *client)
         mon_height = client->monitor->height;
     }
 
-    /* Is it outside the physical monitor? */
-    if (client->x < mon_x)
+    /* Is it outside the physical monitor? */
+    if (client->x < mon_x)
+    {
+        client->x = mon_x;
+    }
+    if (client->y < mon_y)
+    {
+        client->y = mon_y;
+    }
+
+    if (client->x + client->width > mon_x + mon_width - conf.borderwidth * 2)
+    {
+        client->x = (mon_x + mon_width - conf.borderwidth * 2) - client->width;
+    }
+
+    if (client->y + client->height > mon_y + mon_height - conf.borderwidth * 2)
+    {
+        client->y = (mon_y + mon_height - conf.borderwidth * 2)
+            - client->height;
+    }
+
+    updategeom(client);
+}
+
+/*
+ * We changed the position or size of client. Remember to tell the X
+ * server about it later.
+ *
+ * Geometry is sent by commitgeom() when we're done with all the
+ * events we have, so a window moved or resized several times only
+ * gets one ConfigureWindow, or none if it ended up where it was.
+ */
+void updategeom(struct client *client)
+{
+    /* The window we're snapping isn't in the snap index. */
+    if (client != snapclient)
+    {
+        geomgen ++;
+    }
+
+    if (!ILIST_LINKED(&dirtylist, client, dirtylink))
+    {
+        ILIST_INSERT_TAIL(&dirtylist, client, dirtylink);
+    }
+}
+
+/*
+ * Send any geometry changes of client to the X server, but only the
+ * values that have changed since last time.
+ *
+ * Returns true if we sent anything.
+ */
+bool sendgeom(struct client *client)
+{
+    uint32_t values[4];
+    uint32_t mask = 0;
+    int16_t x = client->x;
+    int32_t parkx;
+    int i = 0;
+
+    if (!ILIST_LINKED(&dirtylist, client, dirtylink))
+    {
+        return false;
+    }
+
+    ILIST_REMOVE(&dirtylist, client, dirtylink);
+
+    /*
+     * A parked window keeps its real geometry. Only what we send
+     * puts it just left of the root window, where nothing is ever
+     * visible.
+     */
+    if (client->parked)
+    {
+        parkx = -(client->width + conf.borderwidth * 2);
+        x = parkx < INT16_MIN ? INT16_MIN : parkx;
+    }
+
+    if (x != client->sent.x)
+    {
+        mask |= XCB_CONFIG_WINDOW_X;
+        values[i ++] = x;
+    }
+
+    if (client->y != client->sent.y)
     {
-        client->x = mon_x;
+        mask |= XCB_CONFIG_WINDOW_Y;
+        values[i ++] = client->y;
     }
-    if (client->y < mon_y)
+
+    if (client->width != client->sent.width)
     {
-        client->y = mon_y;
+        mask |= XCB_CONFIG_WINDOW_WIDTH;
+        values[i ++] = client->width;
     }
 
-    if (client->x + client->width > mon_x + mon_width - conf.borderwidth * 2)
+    if (client->height != client->sent.height)
     {
-        client->x = (mon_x + mon_width - conf.borderwidth * 2) - client->width;
+        mask |= XCB_CONFIG_WINDOW_HEIGHT;
+        values[i ++] = client->height;
     }
 
-    if (client->y + client->height > mon_y + mon_height - conf.borderwidth * 2)
+    if (0 == mask)
     {
-        client->y = (mon_y + mon_height - conf.borderwidth * 2)
-            - client->height;
+        return false;
     }
 
-    movewindow(client->id, client->x, client->y);
+    PDEBUG("Configuring %d to %d,%d %d x %d.\n", client->id, x,
+           client->y, client->width, client->height);
+
+    xcb_configure_window(conn, client->id, mask, values);
+
+    client->sent.x = x;
+    client->sent.y = client->y;
+    client->sent.width = client->width;
+    client->sent.height = client->height;
+
+    return true;
 }
 
-/* Move window win to root coordinates x,y. */
-void movewindow(xcb_drawable_t win, uint16_t x, uint16_t y)
+/* Send all geometry changes we haven't sent yet. */
+void commitgeom(void)
 {
-    uint32_t values[2];
-
-    if (screen->root == win || 0 == win)
+    while (!ILIST_EMPTY(&dirtylist))
     {
-        /* Can't move root. */
-        return;
+        sendgeom(ILIST_FIRST(&dirtylist));
     }
+}
 
-    values[0] = x;
-    values[1] = y;
+/*
+ * Tell client where its window is without moving it. ICCCM says we
+ * must do this when we don't let a ConfigureRequest change anything.
+ */
+void configurenotify(struct client *client)
+{
+    xcb_configure_notify_event_t ev;
+
+    memset(&ev, 0, sizeof ev);
+
+    ev.response_type = XCB_CONFIGURE_NOTIFY;
+    ev.event = client->id;
+    ev.window = client->id;
+    ev.above_sibling = XCB_NONE;
+    ev.x = client->x;
+    ev.y = client->y;
+    ev.width = client->width;
+    ev.height = client->height;
+    ev.border_width = client->maxed ? 0 : conf.borderwidth;
+    ev.override_redirect = 0;
+
+    xcb_send_event(conn, false, client->id,
+                   XCB_EVENT_MASK_STRUCTURE_NOTIFY, (char *) &ev);
+}
 
-    xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_X
-                         | XCB_CONFIG_WINDOW_Y, values);
+/*
+ * Warp pointer to x,y relative to client's window. The X server
+ * computes where that is from the window's geometry, so send ours
+ * first.
+ */
+void warppointer(struct client *client, int16_t x, int16_t y)
+{
+    sendgeom(client);
 
-    xcb_flush(conn);
+    xcb_warp_pointer(conn, XCB_NONE, client->id, 0, 0, 0, 0, x, y);
 }
 
 /* Change focus to next in window ring. */
 void focusnext(bool reverse)
 {
     struct client *client = NULL;
+    bool held = true;
 
 #if DEBUG
     if (NULL != focuswin)
@@ -1938,7 +3782,7 @@ void focusnext(bool reverse)
     }
 #endif
 
-    if (NULL == wslist[curws])
+    if (NULL == wsfirst(curws))
     {
         PDEBUG("No windows to focus on in this workspace.\n");
         return;
@@ -1953,17 +3797,18 @@ void focusnext(bool reverse)
          */
         lastfocuswin = focuswin;
         mode = MCWM_TABBING;
+        held = tabgrab();
 
         PDEBUG("Began tabbing.\n");
     }
 
     /* If we currently have no focus focus first in list. */
-    if (NULL == focuswin || NULL == focuswin->wsitem[curws])
+    if (NULL == focuswin || !onworkspace(focuswin, curws))
     {
-        PDEBUG("Focusing first in list: %p\n", wslist[curws]);
-        client = wslist[curws]->data;
+        PDEBUG("Focusing first in list: %p\n", (void *) wsfirst(curws));
+        client = wsfirst(curws);
 
-        if (NULL != focuswin && NULL == focuswin->wsitem[curws])
+        if (NULL != focuswin)
         {
             PDEBUG("XXX Our focused window %d isn't on this workspace!\n",
                    focuswin->id);
@@ -1973,51 +3818,48 @@ void focusnext(bool reverse)
     {
         if (reverse)
         {
-            if (NULL == focuswin->wsitem[curws]->prev)
+            if (NULL == wsprev(focuswin, curws))
             {
                 /*
                  * We were at the head of list. Focusing on last
                  * window in list unless we were already there.
                  */
-                struct item *last = wslist[curws];
-                while (NULL != last->next)
-                    last = last->next;
-                if (focuswin->wsitem[curws] != last->data)
+                if (focuswin != wslast(curws))
                 {
                     PDEBUG("Beginning of list. Focusing last in list: %p\n",
-                           last);
-                    client = last->data;
+                           (void *) wslast(curws));
+                    client = wslast(curws);
                 }
             }
             else
             {
                 /* Otherwise, focus the next in list. */
                 PDEBUG("Tabbing. Focusing next: %p.\n",
-                       focuswin->wsitem[curws]->prev);
-                client = focuswin->wsitem[curws]->prev->data;
+                       (void *) wsprev(focuswin, curws));
+                client = wsprev(focuswin, curws);
             }
         }
         else
         {
-            if (NULL == focuswin->wsitem[curws]->next)
+            if (NULL == wsnext(focuswin, curws))
             {
                 /*
                  * We were at the end of list. Focusing on first window in
                  * list unless we were already there.
                  */
-                if (focuswin->wsitem[curws] != wslist[curws]->data)
+                if (focuswin != wsfirst(curws))
                 {
                     PDEBUG("End of list. Focusing first in list: %p\n",
-                           wslist[curws]);
-                    client = wslist[curws]->data;
+                           (void *) wsfirst(curws));
+                    client = wsfirst(curws);
                 }
             }
             else
             {
                 /* Otherwise, focus the next in list. */
                 PDEBUG("Tabbing. Focusing next: %p.\n",
-                       focuswin->wsitem[curws]->next);
-                client = focuswin->wsitem[curws]->next->data;
+                       (void *) wsnext(focuswin, curws));
+                client = wsnext(focuswin, curws);
             }
         }
     }
@@ -2032,10 +3874,15 @@ void focusnext(bool reverse)
 
         xcb_configure_window(conn, client->id, XCB_CONFIG_WINDOW_STACK_MODE,
                              values);
-        xcb_warp_pointer(conn, XCB_NONE, client->id, 0, 0, 0, 0,
-                         client->width / 2, client->height / 2);
+        warppointer(client, client->width / 2, client->height / 2);
         setfocus(client);
     }
+
+    /* If MODKEY is already up, this was all the tabbing we get. */
+    if (!held)
+    {
+        finishtabbing();
+    }
 }
 
 /* Mark window win as unfocused. */
@@ -2056,31 +3903,16 @@ void setunfocus(xcb_drawable_t win)
     /* Set new border colour. */
     values[0] = conf.unfocuscol;
     xcb_change_window_attributes(conn, win, XCB_CW_BORDER_PIXEL, values);
-
-    xcb_flush(conn);
 }
 
 /*
- * Find client with client->id win in global window list.
+ * Find client with client->id win in window index.
  *
  * Returns client pointer or NULL if not found.
  */
 struct client *findclient(xcb_drawable_t win)
 {
-    struct item *item;
-    struct client *client;
-
-    for (item = winlist; item != NULL; item = item->next)
-    {
-        client = item->data;
-        if (win == client->id)
-        {
-            PDEBUG("findclient: Found it. Win: %d\n", client->id);
-            return client;
-        }
-    }
-
-    return NULL;
+    return hashfind(&winhash, win);
 }
 
 /* Set focus on window client. */
@@ -2103,7 +3935,6 @@ void setfocus(struct client *client)
 
         xcb_set_input_focus(conn, XCB_NONE, XCB_INPUT_FOCUS_POINTER_ROOT,
                             XCB_CURRENT_TIME);
-        xcb_flush(conn);
 
         return;
     }
@@ -2141,8 +3972,6 @@ void setfocus(struct client *client)
     xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT, client->id,
                         XCB_CURRENT_TIME);
 
-    xcb_flush(conn);
-
     /* Remember the new window as the current focused window. */
     focuswin = client;
 }
@@ -2174,6 +4003,9 @@ int start(char *program)
             exit(1);
         }
 
+        /* Don't let the program inherit our blocked signals. */
+        sigprocmask(SIG_SETMASK, &sigmask, NULL);
+
         argv[0] = program;
         argv[1] = NULL;
 
@@ -2234,55 +4066,7 @@ void resizelim(struct client *client)
                                        * 2);
     }
 
-    resize(client->id, client->width, client->height);
-}
-
-void moveresize(xcb_drawable_t win, uint16_t x, uint16_t y,
-                uint16_t width, uint16_t height)
-{
-    uint32_t values[4];
-
-    if (screen->root == win || 0 == win)
-    {
-        /* Can't move or resize root. */
-        return;
-    }
-
-    PDEBUG("Moving to %d, %d, resizing to %d x %d.\n", x, y, width, height);
-
-    values[0] = x;
-    values[1] = y;
-    values[2] = width;
-    values[3] = height;
-
-    xcb_configure_window(conn, win,
-                         XCB_CONFIG_WINDOW_X
-                         | XCB_CONFIG_WINDOW_Y
-                         | XCB_CONFIG_WINDOW_WIDTH
-                         | XCB_CONFIG_WINDOW_HEIGHT, values);
-    xcb_flush(conn);
-}
-
-/* Resize window win to width,height. */
-void resize(xcb_drawable_t win, uint16_t width, uint16_t height)
-{
-    uint32_t values[2];
-
-    if (screen->root == win || 0 == win)
-    {
-        /* Can't resize root. */
-        return;
-    }
-
-    PDEBUG("Resizing to %d x %d.\n", width, height);
-
-    values[0] = width;
-    values[1] = height;
-
-    xcb_configure_window(conn, win,
-                         XCB_CONFIG_WINDOW_WIDTH
-                         | XCB_CONFIG_WINDOW_HEIGHT, values);
-    xcb_flush(conn);
+    updategeom(client);
 }
 
 /*
@@ -2363,9 +4147,7 @@ void resizestep(struct client *client, char direction)
         client->vertmaxed = false;
     }
 
-    xcb_warp_pointer(conn, XCB_NONE, client->id, 0, 0, 0, 0,
-                     client->width / 2, client->height / 2);
-    xcb_flush(conn);
+    warppointer(client, client->width / 2, client->height / 2);
 }
 
 /*
@@ -2373,12 +4155,15 @@ void resizestep(struct client *client, char direction)
  */
 static void snapwindow(struct client *client, int snap_mode)
 {
-    struct item *item;
     struct client *win;
     int16_t mon_x;
     int16_t mon_y;
     uint16_t mon_width;
     uint16_t mon_height;
+    int16_t near;               /* Closest edge before us. */
+    int16_t far;                /* Closest edge after us. */
+    bool isnear;
+    bool isfar;
 
     if (NULL == client->monitor)
     {
@@ -2394,82 +4179,98 @@ static void snapwindow(struct client *client, int snap_mode)
         mon_width = client->monitor->width;
         mon_height = client->monitor->height;
     }
+
     /*
-     * Go through all windows on current workspace.
+     * Collect the edges of all other windows on current workspace,
+     * unless we already have them and nothing has changed since.
+     * Normally this is only done once when we start moving or
+     * resizing.
      */
-    for (item = wslist[curws]; item != NULL; item = item->next)
+    if (client != snapclient || snapgen != geomgen)
     {
-        win = item->data;
+        PDEBUG("Building snap index.\n");
 
-        if (client == win)
-        {
-            continue;
-        }
+        snapclear(&snapidx);
 
-        if (snap_mode == MCWM_MOVE)
+        WS_FOREACH(win, curws)
         {
-            if (abs((win->x +win->width) - client->x) < conf.snapmargin)
+            if (client == win)
             {
-                if (client->y + client->height > win->y
-                    && client->y < win->y + win->height)
-                {
-                    client->x = (win->x + win->width) + (2 * conf.borderwidth);
-                }
+                continue;
             }
 
-            if (abs((win->y +win->height) - client->y) < conf.snapmargin)
+            if (-1 == snapadd(&snapidx, win->x, win->y, win->width,
+                              win->height))
             {
-                if (client->x + client->width >win->x
-                    && client->x < win->x + win->width)
-                {
-                    client->y = (win->y + win->height) + (2 * conf.borderwidth);
-                }
+                PDEBUG("snapwindow: Out of memory.\n");
+                break;
             }
+        }
 
-            if (abs((client->x + client->width) - win->x) < conf.snapmargin)
-            {
-                if (client->y + client->height > win->y
-                    && client->y < win->y + win->height)
-                {
-                    client->x = (win->x - client->width)
-                        - (2 * conf.borderwidth);
-                }
-            }
+        snapsort(&snapidx);
 
-            if (abs((client->y + client->height) - win->y) < conf.snapmargin)
-            {
-                if (client->x + client->width >win->x
-                    && client->x < win->x + win->width)
-                {
-                    client->y = (win->y - client->height)
-                        - (2 * conf.borderwidth);
-                }
-            }
+        snapclient = client;
+        snapgen = geomgen;
+    }
 
-        } /* mcwm_move */
-        else if (snap_mode == MCWM_RESIZE)
+    /*
+     * Snap our edges to the closest edges of other windows we
+     * overlap.
+     */
+    if (snap_mode == MCWM_MOVE)
+    {
+        /* Our left edge to their right or our right edge to their left. */
+        isnear = snapfind(&snapidx, SNAP_RIGHT, client->x,
+                          client->y, client->y + client->height,
+                          conf.snapmargin, &near);
+        isfar = snapfind(&snapidx, SNAP_LEFT, client->x + client->width,
+                         client->y, client->y + client->height,
+                         conf.snapmargin, &far);
+
+        if (isnear && (!isfar || abs(near - client->x)
+                       <= abs(far - (client->x + client->width))))
         {
-            if (abs((client->x + client->width) - win->x) < conf.snapmargin)
-            {
-                if (client->y + client->height > win->y
-                    && client->y < win->y + win->height)
-                {
-                    client->width = (win->x - client->x)
-                        - (2 * conf.borderwidth);
-                }
-            }
+            client->x = near + (2 * conf.borderwidth);
+        }
+        else if (isfar)
+        {
+            client->x = (far - client->width) - (2 * conf.borderwidth);
+        }
 
-            if (abs((client->y + client->height) - win->y) < conf.snapmargin)
-            {
-                if (client->x + client->width >win->x
-                    && client->x < win->x + win->width)
-                {
-                    client->height = (win->y - client->y)
-                        - (2 * conf.borderwidth);
-                }
-            }
-        } /* mcwm_resize */
-    }
+        /* Our top edge to their bottom or our bottom edge to their top. */
+        isnear = snapfind(&snapidx, SNAP_BOTTOM, client->y,
+                          client->x, client->x + client->width,
+                          conf.snapmargin, &near);
+        isfar = snapfind(&snapidx, SNAP_TOP, client->y + client->height,
+                         client->x, client->x + client->width,
+                         conf.snapmargin, &far);
+
+        if (isnear && (!isfar || abs(near - client->y)
+                       <= abs(far - (client->y + client->height))))
+        {
+            client->y = near + (2 * conf.borderwidth);
+        }
+        else if (isfar)
+        {
+            client->y = (far - client->height) - (2 * conf.borderwidth);
+        }
+    } /* mcwm_move */
+    else if (snap_mode == MCWM_RESIZE)
+    {
+        if (snapfind(&snapidx, SNAP_LEFT, client->x + client->width,
+                     client->y, client->y + client->height,
+                     conf.snapmargin, &far))
+        {
+            client->width = (far - client->x) - (2 * conf.borderwidth);
+        }
+
+        if (snapfind(&snapidx, SNAP_TOP, client->y + client->height,
+                     client->x, client->x + client->width,
+                     conf.snapmargin, &far))
+        {
+            client->height = (far - client->y) - (2 * conf.borderwidth);
+        }
+    } /* mcwm_resize */
 
     /* monitor border */
     if (snap_mode == MCWM_MOVE) {
@@ -2513,9 +4314,21 @@ static void snapwindow(struct client *client, int snap_mode)
  */
 void mousemove(struct client *client, int rel_x, int rel_y)
 {
+    struct monitor *mon;
+
     client->x = rel_x;
     client->y = rel_y;
 
+    /*
+     * If the pointer moved onto another monitor, the window goes
+     * with it. Otherwise we would keep it on the old one.
+     */
+    mon = findmonbycoord(rel_x, rel_y);
+    if (NULL != mon)
+    {
+        setmonitor(client, mon);
+    }
+
     if (conf.snapmargin > 0)
     {
         snapwindow(client, MCWM_MOVE);
@@ -2552,6 +4365,66 @@ void mouseresize(struct client *client, int rel_x, int rel_y)
     }
 }
 
+/*
+ * Return how many microseconds to wait between window updates when
+ * moving or resizing a window on monitor mon. rtt is how long a round
+ * trip to the X server just took.
+ */
+int64_t draginterval(struct monitor *mon, int64_t rtt)
+{
+    /* No point in updating more often than the monitor can show. */
+    if (NULL != mon && 0 != mon->refresh)
+    {
+        return 1000000000 / mon->refresh;
+    }
+
+    /*
+     * We don't know the refresh rate, so guess. Don't update faster
+     * than the X server can answer us, though.
+     */
+    if (rtt > 1000000 / DRAG_DEFAULTRATE)
+    {
+        return rtt;
+    }
+
+    return 1000000 / DRAG_DEFAULTRATE;
+}
+
+/*
+ * Move or resize the focused window to the newest pointer position
+ * we've seen.
+ */
+void dragupdate(void)
+{
+    drag.pending = false;
+    drag.last = monotime();
+
+    if (NULL == focuswin || focuswin->maxed)
+    {
+        return;
+    }
+
+    if (MCWM_MOVE == mode)
+    {
+        mousemove(focuswin, drag.x, drag.y);
+    }
+    else if (MCWM_RESIZE == mode)
+    {
+        mouseresize(focuswin, drag.x, drag.y);
+    }
+}
+
+/* Time to apply a pointer position we've held back. */
+void dragtimeout(void *arg)
+{
+    (void) arg;
+
+    if (drag.pending)
+    {
+        dragupdate();
+    }
+}
+
 void movestep(struct client *client, char direction)
 {
     int16_t start_x;
@@ -2608,9 +4481,7 @@ void movestep(struct client *client, char direction)
         + conf.borderwidth && start_y > 0 - conf.borderwidth && start_y
         < client->height + conf.borderwidth)
     {
-        xcb_warp_pointer(conn, XCB_NONE, client->id, 0, 0, 0, 0,
-                         start_x, start_y);
-        xcb_flush(conn);
+        warppointer(client, start_x, start_y);
     }
 }
 
@@ -2623,14 +4494,10 @@ void setborders(struct client *client, int width)
 
     mask |= XCB_CONFIG_WINDOW_BORDER_WIDTH;
     xcb_configure_window(conn, client->id, mask, &values[0]);
-    xcb_flush(conn);
 }
 
 void unmax(struct client *client)
 {
-    uint32_t values[5];
-    uint32_t mask = 0;
-
     if (NULL == client)
     {
         PDEBUG("unmax: client was NULL!\n");
@@ -2643,47 +4510,20 @@ void unmax(struct client *client)
     client->height = client->origsize.height;
 
     /* Restore geometry. */
+    updategeom(client);
+
     if (client->maxed)
     {
-        values[0] = client->x;
-        values[1] = client->y;
-        values[2] = client->width;
-        values[3] = client->height;
-
         /* Set borders again. */
-        values[4] = conf.borderwidth;
-
-        mask =
-            XCB_CONFIG_WINDOW_X
-            | XCB_CONFIG_WINDOW_Y
-            | XCB_CONFIG_WINDOW_WIDTH
-            | XCB_CONFIG_WINDOW_HEIGHT
-            | XCB_CONFIG_WINDOW_BORDER_WIDTH;
-    }
-    else
-    {
-        values[0] = client->y;
-        values[1] = client->width;
-        values[2] = client->height;
-
-        mask = XCB_CONFIG_WINDOW_Y
-            | XCB_CONFIG_WINDOW_WIDTH
-            | XCB_CONFIG_WINDOW_HEIGHT;
+        setborders(client, conf.borderwidth);
     }
 
-    xcb_configure_window(conn, client->id, mask, values);
-
     /* Warp pointer to window or we might lose it. */
-    xcb_warp_pointer(conn, XCB_NONE, client->id, 0, 0, 0, 0,
-                     client->width / 2, client->height / 2);
-
-    xcb_flush(conn);
+    warppointer(client, client->width / 2, client->height / 2);
 }
 
 void maximize(struct client *client)
 {
-    uint32_t values[4];
-    uint32_t mask = 0;
     int16_t mon_x;
     int16_t mon_y;
     uint16_t mon_width;
@@ -2731,9 +4571,7 @@ void maximize(struct client *client)
     client->origsize.height = client->height;
 
     /* Remove borders. */
-    values[0] = 0;
-    mask = XCB_CONFIG_WINDOW_BORDER_WIDTH;
-    xcb_configure_window(conn, client->id, mask, values);
+    setborders(client, 0);
 
     /* Move to top left and resize. */
     client->x = mon_x;
@@ -2741,23 +4579,13 @@ void maximize(struct client *client)
     client->width = mon_width;
     client->height = mon_height;
 
-    values[0] = client->x;
-    values[1] = client->y;
-    values[2] = client->width;
-    values[3] = client->height;
-    xcb_configure_window(conn, client->id, XCB_CONFIG_WINDOW_X
-                         | XCB_CONFIG_WINDOW_Y
-                         | XCB_CONFIG_WINDOW_WIDTH
-                         | XCB_CONFIG_WINDOW_HEIGHT, values);
-
-    xcb_flush(conn);
+    updategeom(client);
 
     client->maxed = true;
 }
 
 void maxvert(struct client *client)
 {
-    uint32_t values[2];
     int16_t mon_y;
     uint16_t mon_height;
 
@@ -2807,12 +4635,7 @@ void maxvert(struct client *client)
         % client->height_inc;
 
     /* Move to top of screen and resize. */
-    values[0] = client->y;
-    values[1] = client->height;
-
-    xcb_configure_window(conn, client->id, XCB_CONFIG_WINDOW_Y
-                         | XCB_CONFIG_WINDOW_HEIGHT, values);
-    xcb_flush(conn);
+    updategeom(client);
 
     /* Remember that this client is vertically maximized. */
     client->vertmaxed = true;
@@ -2820,24 +4643,29 @@ void maxvert(struct client *client)
 
 void hide(struct client *client)
 {
-    long data[] = { XCB_ICCCM_WM_STATE_ICONIC, XCB_NONE };
-
     /*
-     * Unmap window and declare iconic.
-     *
-     * Unmapping will generate an UnmapNotify event so we can forget
-     * about the window later.
+     * Unmap window and declare iconic. We don't manage iconic
+     * windows, so forget about it. If it gets mapped again, we add it
+     * to our lists again then.
      */
     xcb_unmap_window(conn, client->id);
-    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, client->id,
-                        wm_state, wm_state, 32, 2, data);
-    xcb_flush(conn);
+    setwmstate(client->id, XCB_ICCCM_WM_STATE_ICONIC);
+
+    if (focuswin == client)
+    {
+        focuswin = NULL;
+    }
+
+    forgetclient(client);
 }
 
 bool getpointer(xcb_drawable_t win, int16_t *x, int16_t *y)
 {
     xcb_query_pointer_reply_t *pointer;
 
+    /* Make sure the X server knows where our windows are. */
+    commitgeom();
+
     pointer
         = xcb_query_pointer_reply(conn, xcb_query_pointer(conn, win), 0);
     if (NULL == pointer)
@@ -2853,28 +4681,6 @@ bool getpointer(xcb_drawable_t win, int16_t *x, int16_t *y)
     return true;
 }
 
-bool getgeom(xcb_drawable_t win, int16_t *x, int16_t *y, uint16_t *width,
-             uint16_t *height)
-{
-    xcb_get_geometry_reply_t *geom;
-
-    geom
-        = xcb_get_geometry_reply(conn, xcb_get_geometry(conn, win), NULL);
-    if (NULL == geom)
-    {
-        return false;
-    }
-
-    *x = geom->x;
-    *y = geom->y;
-    *width = geom->width;
-    *height = geom->height;
-
-    free(geom);
-
-    return true;
-}
-
 void topleft(void)
 {
     int16_t pointx;
@@ -2907,10 +4713,8 @@ void topleft(void)
 
     focuswin->x = mon_x;
     focuswin->y = mon_y;
-    movewindow(focuswin->id, focuswin->x, focuswin->y);
-    xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0, 0,
-                     pointx, pointy);
-    xcb_flush(conn);
+    updategeom(focuswin);
+    warppointer(focuswin, pointx, pointy);
 }
 
 void topright(void)
@@ -2951,11 +4755,9 @@ void topright(void)
 
     focuswin->y = mon_y;
 
-    movewindow(focuswin->id, focuswin->x, focuswin->y);
+    updategeom(focuswin);
 
-    xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0, 0,
-                     pointx, pointy);
-    xcb_flush(conn);
+    warppointer(focuswin, pointx, pointy);
 }
 
 void botleft(void)
@@ -2994,10 +4796,8 @@ void botleft(void)
     focuswin->x = mon_x;
     focuswin->y = mon_y + mon_height - (focuswin->height + conf.borderwidth
                                         * 2);
-    movewindow(focuswin->id, focuswin->x, focuswin->y);
-    xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0, 0,
-                     pointx, pointy);
-    xcb_flush(conn);
+    updategeom(focuswin);
+    warppointer(focuswin, pointx, pointy);
 }
 
 void botright(void)
@@ -3039,10 +4839,8 @@ void botright(void)
     focuswin->x = mon_x + mon_width - (focuswin->width + conf.borderwidth * 2);
     focuswin->y = mon_y + mon_height - (focuswin->height + conf.borderwidth
                                         * 2);
-    movewindow(focuswin->id, focuswin->x, focuswin->y);
-    xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0, 0,
-                     pointx, pointy);
-    xcb_flush(conn);
+    updategeom(focuswin);
+    warppointer(focuswin, pointx, pointy);
 }
 
 void deletewin(void)
@@ -3091,8 +4889,6 @@ void deletewin(void)
     {
         xcb_kill_client(conn, focuswin->id);
     }
-
-    xcb_flush(conn);
 }
 
 void prevscreen(void)
@@ -3111,255 +4907,213 @@ void prevscreen(void)
         return;
     }
 
-    focuswin->monitor = item->data;
-
-    raisewindow(focuswin->id);
-    fitonscreen(focuswin);
-    movelim(focuswin);
-
-    xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0, 0,
-                     0, 0);
-    xcb_flush(conn);
-}
-
-void nextscreen(void)
-{
-    struct item *item;
-
-    if (NULL == focuswin || NULL == focuswin->monitor)
-    {
-        return;
-    }
-
-    item = focuswin->monitor->item->next;
-
-    if (NULL == item)
-    {
-        return;
-    }
-
-    focuswin->monitor = item->data;
+    setmonitor(focuswin, item->data);
 
     raisewindow(focuswin->id);
     fitonscreen(focuswin);
     movelim(focuswin);
 
-    xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0, 0,
-                     0, 0);
-    xcb_flush(conn);
+    warppointer(focuswin, 0, 0);
 }
 
-void handle_keypress(xcb_key_press_event_t *ev)
-{
-    int i;
-    key_enum_t key;
-
-    for (key = KEY_MAX, i = KEY_F; i < KEY_MAX; i ++)
-    {
-        if (ev->detail == keys[i].keycode && 0 != keys[i].keycode)
-        {
-            key = i;
-            break;
-        }
-    }
-    if (key == KEY_MAX)
-    {
-        PDEBUG("Unknown key pressed.\n");
+void nextscreen(void)
+{
+    struct item *item;
 
-        /*
-         * We don't know what to do with this key. Send this key press
-         * event to the focused window.
-         */
-        xcb_send_event(conn, false, XCB_SEND_EVENT_DEST_ITEM_FOCUS,
-                       XCB_EVENT_MASK_NO_EVENT, (char *) ev);
-        xcb_flush(conn);
+    if (NULL == focuswin || NULL == focuswin->monitor)
+    {
         return;
     }
 
-    if (MCWM_TABBING == mode && key != KEY_TAB && key != KEY_BACKTAB)
-    {
-        /* First finish tabbing around. Then deal with the next key. */
-        finishtabbing();
-    }
+    item = focuswin->monitor->item->next;
 
-    /* Is it shifted? */
-    if (ev->state & SHIFTMOD)
+    if (NULL == item)
     {
-        switch (key)
-        {
-        case KEY_H: /* h */
-            resizestep(focuswin, 'h');
-            break;
+        return;
+    }
 
-        case KEY_J: /* j */
-            resizestep(focuswin, 'j');
-            break;
+    setmonitor(focuswin, item->data);
 
-        case KEY_K: /* k */
-            resizestep(focuswin, 'k');
-            break;
+    raisewindow(focuswin->id);
+    fitonscreen(focuswin);
+    movelim(focuswin);
 
-        case KEY_L: /* l */
-            resizestep(focuswin, 'l');
-            break;
+    warppointer(focuswin, 0, 0);
+}
 
-        case KEY_TAB: /* shifted tab counts as backtab */
-            focusnext(true);
-            break;
+void keyfix(int arg)
+{
+    (void) arg;
 
-        default:
-            /* Ignore other shifted keys. */
-            break;
-        }
-    }
-    else
-    {
-        switch (key)
-        {
-        case KEY_RET: /* return */
-            start(conf.terminal);
-            break;
+    fixwindow(focuswin, true);
+}
 
-        case KEY_F: /* f */
-            fixwindow(focuswin, true);
-            break;
+void keymove(int arg)
+{
+    movestep(focuswin, arg);
+}
 
-        case KEY_H: /* h */
-            movestep(focuswin, 'h');
-            break;
+void keyresize(int arg)
+{
+    resizestep(focuswin, arg);
+}
 
-        case KEY_J: /* j */
-            movestep(focuswin, 'j');
-            break;
+/* Focus next window, or previous if arg is true. */
+void keyfocus(int arg)
+{
+    focusnext(arg);
+}
 
-        case KEY_K: /* k */
-            movestep(focuswin, 'k');
-            break;
+void keymaxvert(int arg)
+{
+    (void) arg;
 
-        case KEY_L: /* l */
-            movestep(focuswin, 'l');
-            break;
+    maxvert(focuswin);
+}
 
-        case KEY_TAB: /* tab */
-            focusnext(false);
-            break;
+void keyraise(int arg)
+{
+    (void) arg;
 
-        case KEY_BACKTAB: /* backtab */
-            focusnext(true);
-            break;
+    raiseorlower(focuswin);
+}
 
-        case KEY_M: /* m */
-            maxvert(focuswin);
-            break;
+void keymax(int arg)
+{
+    (void) arg;
 
-        case KEY_R: /* r*/
-            raiseorlower(focuswin);
-            break;
+    maximize(focuswin);
+}
 
-        case KEY_X: /* x */
-            maximize(focuswin);
-            break;
+void keyterminal(int arg)
+{
+    (void) arg;
 
-        case KEY_1:
-            changeworkspace(0);
-            break;
+    start(conf.terminal);
+}
 
-        case KEY_2:
-            changeworkspace(1);
-            break;
+void keymenu(int arg)
+{
+    (void) arg;
 
-        case KEY_3:
-            changeworkspace(2);
-            break;
+    start(MENU);
+}
 
-        case KEY_4:
-            changeworkspace(3);
-            break;
+/* Change to workspace arg. */
+void keyws(int arg)
+{
+    changeworkspace(arg);
+}
 
-        case KEY_5:
-            changeworkspace(4);
-            break;
+void keyprevws(int arg)
+{
+    (void) arg;
 
-        case KEY_6:
-            changeworkspace(5);
-            break;
+    if (curws > 0)
+    {
+        changeworkspace(curws - 1);
+    }
+    else
+    {
+        changeworkspace(conf.workspaces - 1);
+    }
+}
 
-        case KEY_7:
-            changeworkspace(6);
-            break;
+void keynextws(int arg)
+{
+    (void) arg;
 
-        case KEY_8:
-            changeworkspace(7);
-            break;
+    changeworkspace((curws + 1) % conf.workspaces);
+}
 
-        case KEY_9:
-            changeworkspace(8);
-            break;
+/* Move to corner arg: top left, top right, bottom left, bottom right. */
+void keycorner(int arg)
+{
+    switch (arg)
+    {
+    case 0:
+        topleft();
+        break;
 
-        case KEY_0:
-            changeworkspace(9);
-            break;
+    case 1:
+        topright();
+        break;
 
-        case KEY_Y:
-            topleft();
-            break;
+    case 2:
+        botleft();
+        break;
 
-        case KEY_U:
-            topright();
-            break;
+    case 3:
+        botright();
+        break;
+    }
+}
 
-        case KEY_B:
-            botleft();
-            break;
+void keydelete(int arg)
+{
+    (void) arg;
 
-        case KEY_N:
-            botright();
-            break;
+    deletewin();
+}
 
-        case KEY_END:
-            deletewin();
-            break;
+/* Move to next monitor if arg is true, otherwise previous. */
+void keyscreen(int arg)
+{
+    if (arg)
+    {
+        nextscreen();
+    }
+    else
+    {
+        prevscreen();
+    }
+}
 
-        case KEY_PREVSCR:
-            prevscreen();
-            break;
+void keyiconify(int arg)
+{
+    (void) arg;
 
-        case KEY_NEXTSCR:
-            nextscreen();
-            break;
+    if (conf.allowicons && NULL != focuswin)
+    {
+        hide(focuswin);
+    }
+}
 
-        case KEY_ICONIFY:
-            if (conf.allowicons)
-            {
-                hide(focuswin);
-            }
-            break;
+void handle_keypress(xcb_key_press_event_t *ev)
+{
+    struct keyaction *action;
 
-        case KEY_PREVWS:
-            if (curws > 0)
-            {
-                changeworkspace(curws - 1);
-            }
-            else
-            {
-                changeworkspace(WORKSPACES - 1);
-            }
-            break;
+    /* Locks don't matter, only whether it's shifted. */
+    action = &keytable[ev->detail][0 != (ev->state & ~lockmask & SHIFTMOD)];
 
-        case KEY_NEXTWS:
-            changeworkspace((curws + 1) % WORKSPACES);
-            break;
+    /*
+     * We only grab the keys we have bound, but while tabbing we have
+     * the whole keyboard. Modifiers, such as MODKEY repeating or
+     * SHIFTMOD to go backwards, don't stop tabbing.
+     */
+    if (NULL == action->fn && modifierkeys[ev->detail])
+    {
+        return;
+    }
 
-        case KEY_MENU:
-            start(MENU);
-            break;
+    if (MCWM_TABBING == mode && keyfocus != action->fn)
+    {
+        /* First finish tabbing around. Then deal with the next key. */
+        finishtabbing();
+    }
 
-        default:
-            /* Ignore other keys. */
-            break;
-        } /* switch unshifted */
+    if (NULL == action->fn)
+    {
+        /*
+         * Not ours. We had the keyboard grabbed for tabbing, so the
+         * key is lost.
+         */
+        PDEBUG("Unknown key pressed.\n");
+        return;
     }
-} /* handle_keypress() */
+
+    action->fn(action->arg);
+}
 
 /* Helper function to configure a window. */
 void configwin(xcb_window_t win, uint16_t mask, struct winconf wc)
@@ -3412,7 +5166,6 @@ void configwin(xcb_window_t win, uint16_t mask, struct winconf wc)
     if (-1 != i)
     {
         xcb_configure_window(conn, win, mask, values);
-        xcb_flush(conn);
     }
 }
 
@@ -3508,7 +5261,6 @@ void configurerequest(xcb_configure_request_event_t *e)
             xcb_configure_window(conn, e->window,
                                  XCB_CONFIG_WINDOW_SIBLING,
                                  values);
-            xcb_flush(conn);
 
         }
 
@@ -3520,7 +5272,6 @@ void configurerequest(xcb_configure_request_event_t *e)
             xcb_configure_window(conn, e->window,
                                  XCB_CONFIG_WINDOW_STACK_MODE,
                                  values);
-            xcb_flush(conn);
         }
 
         /* Check if window fits on screen after resizing. */
@@ -3568,8 +5319,15 @@ void configurerequest(xcb_configure_request_event_t *e)
             }
         }
 
-        moveresize(client->id, client->x, client->y, client->width,
-                   client->height);
+        /*
+         * Send the new geometry right away. If nothing changed, tell
+         * the client so anyway.
+         */
+        updategeom(client);
+        if (!sendgeom(client))
+        {
+            configurenotify(client);
+        }
     }
     else
     {
@@ -3590,38 +5348,219 @@ void configurerequest(xcb_configure_request_event_t *e)
     }
 }
 
+/*
+ * Read every event the X server has sent us so far into batch,
+ * without waiting for more.
+ *
+ * While we're at it, drop motion events directly followed by another
+ * motion event and merge ConfigureRequests for the same window, so
+ * only the newest position or geometry is handled.
+ *
+ * Returns the number of events left to handle.
+ */
+unsigned readbatch(void)
+{
+    xcb_generic_event_t *ev;
+    unsigned n = 0;
+    unsigned i;
+
+    batch.len = 0;
+    batch.next = 0;
+
+    for (;;)
+    {
+        /* Make room first so we never have an event we can't keep. */
+        if (batch.len == batch.size && !growbatch())
+        {
+            PDEBUG("readbatch: Out of memory.\n");
+            break;
+        }
+
+        /* Read from the X connection once, then take what's queued. */
+        if (0 == n)
+        {
+            ev = xcb_poll_for_event(conn);
+        }
+        else
+        {
+            ev = xcb_poll_for_queued_event(conn);
+        }
+
+        if (NULL == ev)
+        {
+            break;
+        }
+
+        n ++;
+        addtobatch(ev);
+    }
+
+    /* Don't merge with ConfigureRequests from this batch next time. */
+    for (i = 0; i < batch.len; i ++)
+    {
+        ev = batch.evs[i];
+        if (XCB_CONFIGURE_REQUEST == (ev->response_type & ~0x80))
+        {
+            hashdel(&confhash,
+                    ((xcb_configure_request_event_t *) ev)->window);
+        }
+    }
+
+    PDEBUG("Read %u events, %u to handle.\n", n, batch.len);
+
+    return batch.len;
+}
+
+/*
+ * Make room for more events in batch.
+ *
+ * Returns false if we're out of memory.
+ */
+bool growbatch(void)
+{
+    xcb_generic_event_t **evs;
+    unsigned size;
+
+    size = 0 == batch.size ? 64 : batch.size * 2;
+
+    evs = realloc(batch.evs, size * sizeof (xcb_generic_event_t *));
+    if (NULL == evs)
+    {
+        return false;
+    }
+
+    batch.evs = evs;
+    batch.size = size;
+
+    return true;
+}
+
+/*
+ * Add ev to batch, unless it can be merged with an event already
+ * there. There must be room for one more event.
+ */
+void addtobatch(xcb_generic_event_t *ev)
+{
+    xcb_generic_event_t *last;
+    xcb_configure_request_event_t *cr;
+    xcb_window_t win;
+
+    last = 0 == batch.len ? NULL : batch.evs[batch.len - 1];
+
+    switch (ev->response_type & ~0x80)
+    {
+    case XCB_MOTION_NOTIFY:
+        /* Only the newest pointer position matters. */
+        if (NULL != last
+            && XCB_MOTION_NOTIFY == (last->response_type & ~0x80))
+        {
+            free(last);
+            batch.evs[batch.len - 1] = ev;
+            return;
+        }
+        break;
+
+    case XCB_CONFIGURE_REQUEST:
+        /*
+         * If we already have a ConfigureRequest for this window,
+         * merge this one into it so it's as if the client had asked
+         * for everything at once.
+         */
+        win = ((xcb_configure_request_event_t *) ev)->window;
+        cr = hashfind(&confhash, win);
+        if (NULL != cr)
+        {
+            mergeconfig(cr, (xcb_configure_request_event_t *) ev);
+            free(ev);
+            return;
+        }
+
+        /* If we're out of memory, later requests just won't merge. */
+        hashadd(&confhash, win, ev);
+        break;
+
+    /*
+     * Don't merge ConfigureRequests from before and after the window
+     * changed state.
+     */
+    case XCB_MAP_REQUEST:
+        hashdel(&confhash, ((xcb_map_request_event_t *) ev)->window);
+        break;
+
+    case XCB_UNMAP_NOTIFY:
+        hashdel(&confhash, ((xcb_unmap_notify_event_t *) ev)->window);
+        break;
+
+    case XCB_DESTROY_NOTIFY:
+        hashdel(&confhash, ((xcb_destroy_notify_event_t *) ev)->window);
+        break;
+    }
+
+    batch.evs[batch.len ++] = ev;
+}
+
+/* Merge the ConfigureRequest from into to. from wins. */
+void mergeconfig(xcb_configure_request_event_t *to,
+                 xcb_configure_request_event_t *from)
+{
+    if (from->value_mask & XCB_CONFIG_WINDOW_X)
+    {
+        to->x = from->x;
+    }
+
+    if (from->value_mask & XCB_CONFIG_WINDOW_Y)
+    {
+        to->y = from->y;
+    }
+
+    if (from->value_mask & XCB_CONFIG_WINDOW_WIDTH)
+    {
+        to->width = from->width;
+    }
+
+    if (from->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
+    {
+        to->height = from->height;
+    }
+
+    if (from->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+    {
+        to->border_width = from->border_width;
+    }
+
+    if (from->value_mask & XCB_CONFIG_WINDOW_SIBLING)
+    {
+        to->sibling = from->sibling;
+    }
+
+    if (from->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)
+    {
+        to->stack_mode = from->stack_mode;
+    }
+
+    to->value_mask |= from->value_mask;
+}
+
 void events(void)
 {
     xcb_generic_event_t *ev;
+    bool first = true;
 
     int16_t mode_x = 0;             /* X coord when in special mode */
     int16_t mode_y = 0;             /* Y coord when in special mode */
-    int fd;                         /* Our X file descriptor */
-    fd_set in;                      /* For select */
-    int found;                      /* Ditto. */
-
-    /* Get the file descriptor so we can do select() on it. */
-    fd = xcb_get_file_descriptor(conn);
 
     for (sigcode = 0; 0 == sigcode;)
     {
-        /* Prepare for select(). */
-        FD_ZERO(&in);
-        FD_SET(fd, &in);
-
         /*
-         * Check for events, again and again. When poll returns NULL
-         * (and it does that a lot), we block on select() until the
-         * event file descriptor gets readable again.
-         *
-         * We do it this way instead of xcb_wait_for_event() since
-         * select() will return if we were interrupted by a signal. We
-         * like that.
+         * Handle events a batch at a time. When we've handled them
+         * all, read everything the X server has sent since. If there
+         * is nothing (and that happens a lot), we sleep in looprun()
+         * until the X connection gets readable again, a signal
+         * arrives or a timer expires.
          */
-        ev = xcb_poll_for_event(conn);
-        if (NULL == ev)
+        if (batch.next == batch.len && 0 == readbatch())
         {
-            PDEBUG("xcb_poll_for_event() returned NULL.\n");
+            PDEBUG("No events.\n");
 
             /*
              * Check if we have an unrecoverable connection error,
@@ -3633,27 +5572,37 @@ void events(void)
                 exit(1);
             }
 
-            found = select(fd + 1, &in, NULL, NULL, NULL);
-            if (-1 == found)
-            {
-                if (EINTR == errno)
-                {
-                    /* We received a signal. Break out of loop. */
-                    break;
-                }
-                else
-                {
-                    /* Something was seriously wrong with select(). */
-                    fprintf(stderr, "mcwm: select failed.");
-                    cleanup(0);
-                    exit(1);
-                }
-            }
-            else
+            /*
+             * We've handled every event we had. Send all requests
+             * the event handlers queued up in one go before we go to
+             * sleep, geometry changes first.
+             *
+             * Event handlers don't flush on their own. The exception
+             * is when the X server must see a request, such as a
+             * pointer grab or ungrab, before anything else happens.
+             */
+            commitgeom();
+            xcb_flush(conn);
+
+            /*
+             * Signals and timers are handled by their watch
+             * functions. Then go back and look for more X events.
+             */
+            if (-1 == looprun(-1))
             {
-                /* We found more events. Goto start of loop. */
-                continue;
+                cleanup(0);
+                exit(1);
             }
+
+            continue;
+        }
+
+        ev = batch.evs[batch.next ++];
+
+        if (first)
+        {
+            trace("first event");
+            first = false;
         }
 
 #ifdef DEBUG
@@ -3667,12 +5616,10 @@ void events(void)
         }
 #endif
 
-        /* Note that we ignore XCB_RANDR_NOTIFY. */
-        if (ev->response_type
-            == randrbase + XCB_RANDR_SCREEN_CHANGE_NOTIFY)
+        if (-1 != randrbase
+            && ev->response_type == randrbase + XCB_RANDR_NOTIFY)
         {
-            PDEBUG("RANDR screen change notify. Checking outputs.\n");
-            getrandr();
+            randrnotify((xcb_randr_notify_event_t *) ev);
             free(ev);
             continue;
         }
@@ -3735,6 +5682,12 @@ void events(void)
                    e->detail, (long)e->event, e->child, e->event_x,
                    e->event_y);
 
+            /* Don't leave the keyboard grabbed. */
+            if (MCWM_TABBING == mode)
+            {
+                finishtabbing();
+            }
+
             if (0 == e->child)
             {
                 /* Mouse click on root window. Start programs? */
@@ -3784,6 +5737,7 @@ void events(void)
             {
                 int16_t pointx;
                 int16_t pointy;
+                int64_t rtt;
 
                 /* We're moving or resizing. */
 
@@ -3791,15 +5745,27 @@ void events(void)
                  * Get and save pointer position inside the window
                  * so we can go back to it when we're done moving
                  * or resizing.
+                 *
+                 * Time it while we're at it, in case we don't know
+                 * how fast the monitor is.
                  */
+                rtt = monotime();
                 if (!getpointer(focuswin->id, &pointx, &pointy))
                 {
                     break;
                 }
+                rtt = monotime() - rtt;
 
                 mode_x = pointx;
                 mode_y = pointy;
 
+                drag.interval = draginterval(focuswin->monitor, rtt);
+                drag.last = 0;
+                drag.pending = false;
+
+                PDEBUG("Updating window every %lld us.\n",
+                       (long long) drag.interval);
+
                 /* Raise window. */
                 raisewindow(focuswin->id);
 
@@ -3812,8 +5778,7 @@ void events(void)
                      * Warp pointer to upper left of window before
                      * starting move.
                      */
-                    xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0, 0,
-                                     1, 1);
+                    warppointer(focuswin, 1, 1);
                 }
                 else
                 {
@@ -3822,8 +5787,7 @@ void events(void)
                     mode = MCWM_RESIZE;
 
                     /* Warp pointer to lower right. */
-                    xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0,
-                                     0, focuswin->width, focuswin->height);
+                    warppointer(focuswin, focuswin->width, focuswin->height);
                 }
 
                 /*
@@ -3839,8 +5803,7 @@ void events(void)
                  */
                 xcb_grab_pointer(conn, 0, screen->root,
                                  XCB_EVENT_MASK_BUTTON_RELEASE
-                                 | XCB_EVENT_MASK_BUTTON_MOTION
-                                 | XCB_EVENT_MASK_POINTER_MOTION_HINT,
+                                 | XCB_EVENT_MASK_BUTTON_MOTION,
                                  XCB_GRAB_MODE_ASYNC,
                                  XCB_GRAB_MODE_ASYNC,
                                  screen->root,
@@ -3856,7 +5819,14 @@ void events(void)
 
         case XCB_MOTION_NOTIFY:
         {
-            xcb_query_pointer_reply_t *pointer;
+            xcb_motion_notify_event_t *e;
+            int64_t now;
+
+            /*
+             * readbatch() has already thrown away any older motion
+             * events directly before this one.
+             */
+            e = (xcb_motion_notify_event_t *) ev;
 
             /*
              * We can't do anything if we don't have a focused window
@@ -3868,39 +5838,39 @@ void events(void)
             }
 
             /*
-             * This is not really a real notify, but just a hint that
-             * the mouse pointer moved. This means we need to get the
-             * current pointer position ourselves.
+             * Our pointer is moving and since we even get this event
+             * we're either resizing or moving a window.
              */
-            pointer = xcb_query_pointer_reply(
-                conn, xcb_query_pointer(conn, screen->root), 0);
-
-            if (NULL == pointer)
+            if (MCWM_MOVE != mode && MCWM_RESIZE != mode)
             {
-                PDEBUG("Couldn't get pointer position.\n");
+                PDEBUG("Motion event when we're not moving our resizing!\n");
                 break;
             }
 
             /*
-             * Our pointer is moving and since we even get this event
-             * we're either resizing or moving a window.
+             * Remember where the pointer is but don't update the
+             * window more often than the monitor refreshes. If it's
+             * too early, set a timer to do it when it's time, unless
+             * we already have one running.
              */
-            if (mode == MCWM_MOVE)
-            {
-                mousemove(focuswin, pointer->root_x, pointer->root_y);
-            }
-            else if (mode == MCWM_RESIZE)
+            drag.x = e->root_x;
+            drag.y = e->root_y;
+
+            now = monotime();
+            if (now - drag.last >= drag.interval)
             {
-                mouseresize(focuswin, pointer->root_x, pointer->root_y);
+                dragupdate();
             }
-            else
+            else if (!drag.pending)
             {
-                PDEBUG("Motion event when we're not moving our resizing!\n");
+                drag.pending = true;
+                if (-1 == looparm(dragtimer,
+                                  drag.last + drag.interval - now))
+                {
+                    dragupdate();
+                }
             }
-
-            free(pointer);
         }
-
         break;
 
         case XCB_BUTTON_RELEASE:
@@ -3937,6 +5907,13 @@ void events(void)
                     break;
                 }
 
+                /* Make sure the window ends up exactly where we are. */
+                if (drag.pending)
+                {
+                    looparm(dragtimer, 0);
+                    dragupdate();
+                }
+
                 /*
                  * We will get an EnterNotify and focus another window
                  * if the pointer just happens to be on top of another
@@ -3974,8 +5951,7 @@ void events(void)
                     y = mode_y;
                 }
 
-                xcb_warp_pointer(conn, XCB_NONE, focuswin->id, 0, 0, 0, 0,
-                                 x, y);
+                warppointer(focuswin, x, y);
                 xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
                 xcb_flush(conn); /* Important! */
 
@@ -4078,12 +6054,11 @@ void events(void)
                              */
                             if (NULL != focuswin)
                             {
-                                movetohead(&wslist[curws],
-                                           focuswin->wsitem[curws]);
+                                movetowshead(focuswin);
                                 lastfocuswin = NULL;
                             }
 
-                            movetohead(&wslist[curws], client->wsitem[curws]);
+                            movetowshead(client);
                         }
 
                         setfocus(client);
@@ -4133,8 +6108,8 @@ void events(void)
                          * the new root geometry here.
                          *
                          * With RANDR enabled, we handle this per
-                         * screen getrandr() when we receive an
-                         * XCB_RANDR_SCREEN_CHANGE_NOTIFY event.
+                         * monitor in randrtimeout() after the
+                         * XCB_RANDR_NOTIFY events about it.
                          */
                         arrangewindows();
                     }
@@ -4151,21 +6126,16 @@ void events(void)
         {
             xcb_client_message_event_t *e
                 = (xcb_client_message_event_t *)ev;
+            struct client *client;
 
             if (conf.allowicons)
             {
                 if (e->type == wm_change_state
                     && e->format == 32
-                    && e->data.data32[0] == XCB_ICCCM_WM_STATE_ICONIC)
+                    && e->data.data32[0] == XCB_ICCCM_WM_STATE_ICONIC
+                    && NULL != (client = findclient(e->window)))
                 {
-                    long data[] = { XCB_ICCCM_WM_STATE_ICONIC, XCB_NONE };
-
-                    /* Unmap window and declare iconic. */
-
-                    xcb_unmap_window(conn, e->window);
-                    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, e->window,
-                                        wm_state, wm_state, 32, 2, data);
-                    xcb_flush(conn);
+                    hide(client);
                 }
             }
         }
@@ -4192,12 +6162,6 @@ void events(void)
             xcb_mapping_notify_event_t *e
                 = (xcb_mapping_notify_event_t *)ev;
 
-            /*
-             * XXX Gah! We get a new notify message for *every* key!
-             * We want to know when the entire keyboard is finished.
-             * Impossible? Better handling somehow?
-             */
-
             /*
              * We're only interested in keys and modifiers, not
              * pointer mappings, for instance.
@@ -4208,11 +6172,12 @@ void events(void)
                 break;
             }
 
-            /* Forget old key bindings. */
-            xcb_ungrab_key(conn, XCB_GRAB_ANY, screen->root, XCB_MOD_MASK_ANY);
-
-            /* Use the new ones. */
-            setupkeys();
+            /*
+             * Changing the keyboard mapping gives us a notify for
+             * every key. Wait until they stop coming, then set up our
+             * keys once.
+             */
+            looparm(keymaptimer, KEYMAP_SETTLE);
         }
         break;
 
@@ -4220,42 +6185,36 @@ void events(void)
         {
             xcb_unmap_notify_event_t *e =
                 (xcb_unmap_notify_event_t *)ev;
-            struct item *item;
             struct client *client;
 
             /*
-             * Find the window in our *current* workspace list, then
-             * forget about it. If it gets mapped, we add it to our
-             * lists again then.
+             * Find the window. If the client withdrew it, forget
+             * about it. If it gets mapped, we add it to our lists
+             * again then.
              *
              * Note that we might not know about the window we got the
-             * UnmapNotify event for. It might be a window we just
-             * unmapped on *another* workspace when changing
-             * workspaces, for instance, or it might be a window with
+             * UnmapNotify event for. It might be a window with
              * override redirect set. This is not an error.
              *
-             * XXX We might need to look in the global window list,
-             * after all. Consider if a window is unmapped on our last
-             * workspace while changing workspaces... If we do this,
-             * we need to keep track of our own windows and ignore
-             * UnmapNotify on them.
+             * An UnmapNotify caused by our own UnmapWindow has the
+             * sequence number of that request. Ignore it.
+             *
+             * A client withdrawing a window we have already unmapped
+             * sends a synthetic UnmapNotify instead. That one is
+             * always the client's.
              */
-            for (item = wslist[curws]; item != NULL; item = item->next)
+            client = findclient(e->window);
+            if (NULL != client
+                && ((ev->response_type & 0x80)
+                    || ev->full_sequence != client->unmapseq))
             {
-                client = item->data;
-
-                if (client->id == e->window)
+                PDEBUG("Forgetting about %d\n", e->window);
+                if (focuswin == client)
                 {
-                    PDEBUG("Forgetting about %d\n", e->window);
-                    if (focuswin == client)
-                    {
-                        focuswin = NULL;
-                    }
-
-                    forgetclient(client);
-                    /* We're finished. Break out of for loop. */
-                    break;
+                    focuswin = NULL;
                 }
+
+                forgetclient(client);
             }
         }
         break;
@@ -4265,51 +6224,203 @@ void events(void)
         /* Forget about this event. */
         free(ev);
     }
+
+    /* Forget about the events we didn't get to. */
+    while (batch.next < batch.len)
+    {
+        free(batch.evs[batch.next ++]);
+    }
 }
 
 void printhelp(void)
 {
-    printf("mcwm: Usage: mcwm [-b] [-s snapmargin] [-t terminal-program] "
-           "[-f colour] [-u colour] [-x colour] \n");
+    printf("mcwm: Usage: mcwm [-b] [-p] [-s snapmargin] [-t terminal-program] "
+           "[-f colour] [-u colour] [-x colour] [-w workspaces] [-T] \n");
     printf("  -b means draw no borders\n");
+    printf("  -p hides windows on other workspaces by moving them off "
+           "screen\n");
     printf("  -s snapmargin in pixels\n");
     printf("  -t urxvt will start urxvt when MODKEY + Return is pressed\n");
     printf("  -f colour sets colour for focused window borders of focused "
            "to a named color.\n");
     printf("  -u colour sets colour for unfocused window borders.\n");
     printf("  -x color sets colour for fixed window borders.\n");
+    printf("  -w workspaces sets the number of workspaces, at most %d.\n",
+           MAXWORKSPACES);
+    printf("  -T prints how long each part of startup takes\n");
+}
+
+/*
+ * Block the signals we care about and arrange to read them from
+ * sigfd instead. This way they can't interrupt us in the middle of
+ * something. They're handled by readsignals() from the event loop.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int setupsignals(void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGCHLD);
+
+    if (-1 == sigprocmask(SIG_BLOCK, &set, &sigmask))
+    {
+        perror("mcwm: sigprocmask");
+        return -1;
+    }
+
+    sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (-1 == sigfd)
+    {
+        perror("mcwm: signalfd");
+        return -1;
+    }
+
+    return 0;
 }
 
-void sigcatch(int sig)
+/* We have signals waiting on sigfd. */
+void readsignals(void *arg)
 {
-    sigcode = sig;
+    struct signalfd_siginfo si;
+
+    (void) arg;
+
+    while (sizeof si == read(sigfd, &si, sizeof si))
+    {
+        PDEBUG("Got signal %d.\n", si.ssi_signo);
+
+        if (SIGCHLD == si.ssi_signo)
+        {
+            /*
+             * Signals of the same kind are merged, so one SIGCHLD
+             * might mean several dead children. Don't create
+             * zombies.
+             */
+            while (0 < waitpid(-1, NULL, WNOHANG))
+                ;
+        }
+        else
+        {
+            sigcode = si.ssi_signo;
+        }
+    }
 }
 
 /*
- * Get a defined atom from the X server.
+ * Set up the event loop to watch the X connection and our signals,
+ * and create the timers we need.
+ *
+ * Returns 0 on success, -1 on error.
  */
-xcb_atom_t getatom(char *atom_name)
+int setuploop(void)
 {
-    xcb_intern_atom_cookie_t atom_cookie;
-    xcb_atom_t atom;
-    xcb_intern_atom_reply_t *rep;
-
-    atom_cookie = xcb_intern_atom(conn, 0, strlen(atom_name), atom_name);
-    rep = xcb_intern_atom_reply(conn, atom_cookie, NULL);
-    if (NULL != rep)
+    if (-1 == loopinit())
     {
-        atom = rep->atom;
-        free(rep);
-        return atom;
+        return -1;
     }
 
     /*
-     * XXX Note that we return 0 as an atom if anything goes wrong.
-     * Might become interesting.
+     * Nothing to do when the X connection is readable. The event
+     * loop looks for X events every time looprun() returns.
      */
+    if (NULL == loopwatch(xcb_get_file_descriptor(conn), NULL, NULL))
+    {
+        return -1;
+    }
+
+    if (NULL == loopwatch(sigfd, readsignals, NULL))
+    {
+        return -1;
+    }
+
+    if (NULL == (dragtimer = looptimer(dragtimeout, NULL)))
+    {
+        return -1;
+    }
+
+    if (NULL == (keymaptimer = looptimer(keymaptimeout, NULL)))
+    {
+        return -1;
+    }
+
+    if (NULL == (randrtimer = looptimer(randrtimeout, NULL)))
+    {
+        return -1;
+    }
+
     return 0;
 }
 
+/* Return monotonic time in microseconds. */
+int64_t monotime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Ask the X server for all atoms in atoms[]. */
+void askatoms(xcb_intern_atom_cookie_t *cookies)
+{
+    unsigned i;
+
+    for (i = 0; i < NATOMS; i ++)
+    {
+        cookies[i] = xcb_intern_atom(conn, 0, strlen(atoms[i].name),
+                                     atoms[i].name);
+    }
+}
+
+/* Get the atoms asked for with askatoms(). */
+void getatoms(xcb_intern_atom_cookie_t *cookies)
+{
+    xcb_intern_atom_reply_t *rep;
+    unsigned i;
+
+    for (i = 0; i < NATOMS; i ++)
+    {
+        rep = xcb_intern_atom_reply(conn, cookies[i], NULL);
+        if (NULL != rep)
+        {
+            *atoms[i].atom = rep->atom;
+            free(rep);
+        }
+        else
+        {
+            /*
+             * XXX Note that we use 0 as an atom if anything goes
+             * wrong. Might become interesting.
+             */
+            *atoms[i].atom = 0;
+        }
+    }
+}
+
+/*
+ * If we're tracing startup, print how long the phase that just ended
+ * took and how long we've been running.
+ */
+void trace(const char *phase)
+{
+    int64_t now;
+
+    if (!conf.trace)
+    {
+        return;
+    }
+
+    now = monotime();
+    fprintf(stderr, "mcwm: %-12s %8lld us %8lld us total\n", phase,
+            (long long) (now - tracelast), (long long) (now - tracestart));
+    tracelast = now;
+}
+
 int main(int argc, char **argv)
 {
     uint32_t mask = 0;
@@ -4323,25 +6434,18 @@ int main(int argc, char **argv)
     char *fixedcol;
     int scrno;
     xcb_screen_iterator_t iter;
+    xcb_intern_atom_cookie_t atomcookies[NATOMS];
+    xcb_query_tree_cookie_t treecookie;
+    xcb_key_symbols_t *keysyms;
+    xcb_get_modifier_mapping_cookie_t modcookie;
+    struct colour colours[3];
+    unsigned i;
 
-    /* Install signal handlers. */
-
-    /* We ignore child exists. Don't create zombies. */
-    if (SIG_ERR == signal(SIGCHLD, SIG_IGN))
-    {
-        perror("mcwm: signal");
-        exit(1);
-    }
-
-    if (SIG_ERR == signal(SIGINT, sigcatch))
-    {
-        perror("mcwm: signal");
-        exit(1);
-    }
+    tracestart = tracelast = monotime();
 
-    if (SIG_ERR == signal(SIGTERM, sigcatch))
+    /* Take care of signals. */
+    if (-1 == setupsignals())
     {
-        perror("mcwm: signal");
         exit(1);
     }
 
@@ -4351,13 +6455,15 @@ int main(int argc, char **argv)
     conf.snapmargin = SNAPMARGIN;
     conf.terminal = TERMINAL;
     conf.allowicons = ALLOWICONS;
+    conf.parkwindows = PARKWINDOWS;
+    conf.workspaces = WORKSPACES;
     focuscol = FOCUSCOL;
     unfocuscol = UNFOCUSCOL;
     fixedcol = FIXEDCOL;
 
     while (1)
     {
-        ch = getopt(argc, argv, "b:s:it:f:u:x:");
+        ch = getopt(argc, argv, "b:s:ipt:f:u:x:w:T");
         if (-1 == ch)
         {
 
@@ -4381,6 +6487,10 @@ int main(int argc, char **argv)
             conf.allowicons = true;
             break;
 
+        case 'p':
+            conf.parkwindows = true;
+            break;
+
         case 't':
             conf.terminal = optarg;
             break;
@@ -4397,12 +6507,37 @@ int main(int argc, char **argv)
             fixedcol = optarg;
             break;
 
+        case 'T':
+            conf.trace = true;
+            break;
+
+        case 'w':
+            conf.workspaces = atoi(optarg);
+            if (conf.workspaces < 1 || conf.workspaces > MAXWORKSPACES)
+            {
+                fprintf(stderr, "mcwm: Number of workspaces must be 1 "
+                        "to %d.\n", MAXWORKSPACES);
+                exit(1);
+            }
+            break;
+
         default:
             printhelp();
             exit(0);
         } /* switch */
     }
 
+    wslist = calloc(conf.workspaces, sizeof (struct clientlist));
+    if (NULL == wslist)
+    {
+        fprintf(stderr, "mcwm: Out of memory.\n");
+        exit(1);
+    }
+
+    /* Make room for a link to every workspace list in every client. */
+    clientpool.size += conf.workspaces
+        * sizeof (((struct client *) NULL)->wslink[0]);
+
     /*
      * Use $DISPLAY. After connecting scrno will contain the value of
      * the display's screen.
@@ -4414,9 +6549,11 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    trace("connect");
+
     /* Find our screen. */
     iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
-    for (int i = 0; i < scrno; ++ i)
+    for (i = 0; i < (unsigned) scrno; i ++)
     {
         xcb_screen_next(&iter);
     }
@@ -4434,37 +6571,105 @@ int main(int argc, char **argv)
     PDEBUG("Screen size: %dx%d\nRoot window: %d\n", screen->width_in_pixels,
            screen->height_in_pixels, screen->root);
 
-    /* Get some colours. */
-    conf.focuscol = getcolor(focuscol);
-    conf.unfocuscol = getcolor(unfocuscol);
-    conf.fixedcol = getcolor(fixedcol);
+    /*
+     * Send everything we need to know before we can start before we
+     * wait for any of it, so we wait for the X server about once
+     * instead of once for every question.
+     */
+
+    /* Are we the only window manager? */
+    mask = XCB_CW_EVENT_MASK;
+
+    values[0] = XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT
+        | XCB_EVENT_MASK_STRUCTURE_NOTIFY
+        | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+
+    cookie =
+        xcb_change_window_attributes_checked(conn, root, mask, values);
 
     /* Get some atoms. */
-    atom_desktop = getatom("_NET_WM_DESKTOP");
-    wm_delete_window = getatom("WM_DELETE_WINDOW");
-    wm_change_state = getatom("WM_CHANGE_STATE");
-    wm_state = getatom("WM_STATE");
-    wm_protocols = getatom("WM_PROTOCOLS");
+    askatoms(atomcookies);
+
+    /* Get some colours. */
+    colours[0].name = focuscol;
+    colours[0].pixel = &conf.focuscol;
+    colours[1].name = unfocuscol;
+    colours[1].pixel = &conf.unfocuscol;
+    colours[2].name = fixedcol;
+    colours[2].pixel = &conf.fixedcol;
+
+    for (i = 0; i < 3; i ++)
+    {
+        askcolour(&colours[i]);
+    }
+
+    /* Is there RANDR? */
+    xcb_prefetch_extension_data(conn, &xcb_randr_id);
+
+    /* All windows already there. */
+    treecookie = xcb_query_tree(conn, screen->root);
+
+    /* What our keys are. */
+    keysyms = xcb_key_symbols_alloc(conn);
+    modcookie = xcb_get_modifier_mapping_unchecked(conn);
+
+    xcb_flush(conn);
+
+    trace("requests");
+
+    /*
+     * We only get SubstructureRedirect if nobody else has it. Since
+     * we started managing windows the moment the X server handled
+     * this, windows mapped from now on get a MapRequest. The ones
+     * already mapped are in our QueryTree reply.
+     */
+    error = xcb_request_check(conn, cookie);
+    if (NULL != error)
+    {
+        fprintf(stderr, "mcwm: Can't get SUBSTRUCTURE REDIRECT. "
+                "Error code: %d\n"
+                "Another window manager running? Exiting.\n",
+                error->error_code);
+
+        xcb_disconnect(conn);
+
+        exit(1);
+    }
+
+    getatoms(atomcookies);
+
+    for (i = 0; i < 3; i ++)
+    {
+        getcolour(&colours[i]);
+    }
+
+    trace("replies");
 
     /* Check for RANDR extension and configure. */
     randrbase = setuprandr();
 
+    trace("randr");
+
     /* Loop over all clients and set up stuff. */
-    if (0 != setupscreen())
+    if (0 != setupscreen(treecookie))
     {
         fprintf(stderr, "mcwm: Failed to initialize windows. Exiting.\n");
         xcb_disconnect(conn);
         exit(1);
     }
 
+    trace("windows");
+
     /* Set up key bindings. */
-    if (0 != setupkeys())
+    if (0 != setupkeys(keysyms, modcookie))
     {
         fprintf(stderr, "mcwm: Couldn't set up keycodes. Exiting.");
         xcb_disconnect(conn);
         exit(1);
     }
 
+    trace("keys");
+
     /* Grab mouse buttons. */
 
     xcb_grab_button(conn, 0, root, XCB_EVENT_MASK_BUTTON_PRESS
@@ -4485,31 +6690,15 @@ int main(int argc, char **argv)
                     3 /* right mouse button */,
                     MODKEY);
 
-    /* Subscribe to events. */
-    mask = XCB_CW_EVENT_MASK;
-
-    values[0] = XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT
-        | XCB_EVENT_MASK_STRUCTURE_NOTIFY
-        | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
-
-    cookie =
-        xcb_change_window_attributes_checked(conn, root, mask, values);
-    error = xcb_request_check(conn, cookie);
-
     xcb_flush(conn);
 
-    if (NULL != error)
+    if (-1 == setuploop())
     {
-        fprintf(stderr, "mcwm: Can't get SUBSTRUCTURE REDIRECT. "
-                "Error code: %d\n"
-                "Another window manager running? Exiting.\n",
-                error->error_code);
-
-        xcb_disconnect(conn);
-
-        exit(1);
+        cleanup(1);
     }
 
+    trace("ready");
+
     /* Loop over events. */
     events();
 
@@ -0,0 +1,488 @@
+#ifdef BENCH
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "snap.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/*
+ * Look at edges first up to end in e for the one closest to pos that
+ * overlaps lo to hi and is closer than *best. If found, update *best
+ * to its distance and *found to its position.
+ *
+ * scanscalar() looks at one edge at a time. scansse2() looks at eight
+ * at a time. Use snapscan() to get the best one we have.
+ */
+static void scanscalar(const struct edges *e, unsigned first, unsigned end,
+                       int pos, int lo, int hi, int *best, int16_t *found);
+#ifdef __SSE2__
+static void scansse2(const struct edges *e, unsigned first, unsigned end,
+                     int pos, int lo, int hi, int *best, int16_t *found);
+#define snapscan scansse2
+#else
+#define snapscan scanscalar
+#endif
+
+static int edgecmp(const void *a, const void *b)
+{
+    const struct edge *ea = a;
+    const struct edge *eb = b;
+
+    return ea->pos - eb->pos;
+}
+
+/* Return the first of the n positions in pos that is >= value. */
+static unsigned lowerbound(const int16_t *pos, unsigned n, int value)
+{
+    unsigned first = 0;
+    unsigned mid;
+
+    while (first < n)
+    {
+        mid = first + (n - first) / 2;
+        if (pos[mid] < value)
+        {
+            first = mid + 1;
+        }
+        else
+        {
+            n = mid;
+        }
+    }
+
+    return first;
+}
+
+/* Clamp value to what fits in an int16_t. */
+static int16_t clamp16(int value)
+{
+    if (value < INT16_MIN)
+    {
+        return INT16_MIN;
+    }
+
+    if (value > INT16_MAX)
+    {
+        return INT16_MAX;
+    }
+
+    return value;
+}
+
+static void scanscalar(const struct edges *e, unsigned first, unsigned end,
+                       int pos, int lo, int hi, int *best, int16_t *found)
+{
+    unsigned i;
+    int dist;
+
+    for (i = first; i < end; i ++)
+    {
+        if (lo >= e->hi[i] || hi <= e->lo[i])
+        {
+            continue;
+        }
+
+        dist = abs(e->pos[i] - pos);
+        if (dist < *best)
+        {
+            *best = dist;
+            *found = e->pos[i];
+        }
+    }
+}
+
+#ifdef __SSE2__
+static void scansse2(const struct edges *e, unsigned first, unsigned end,
+                     int pos, int lo, int hi, int *best, int16_t *found)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vpos = _mm_set1_epi16(clamp16(pos));
+    const __m128i vlo = _mm_set1_epi16(clamp16(lo));
+    const __m128i vhi = _mm_set1_epi16(clamp16(hi));
+    __m128i bestdist = _mm_set1_epi16(INT16_MAX);
+    __m128i bestpos = zero;
+    __m128i p;
+    __m128i d;
+    __m128i ok;
+    int16_t dists[8];
+    int16_t poss[8];
+    unsigned i;
+    int j;
+
+    if (end - first < 8)
+    {
+        scanscalar(e, first, end, pos, lo, hi, best, found);
+        return;
+    }
+
+    /*
+     * Every lane keeps the closest overlapping edge it has seen.
+     * Saturating arithmetic keeps distances right even far away.
+     */
+    for (i = first; i + 8 <= end; i += 8)
+    {
+        p = _mm_loadu_si128((const __m128i *) (e->pos + i));
+
+        d = _mm_subs_epi16(p, vpos);
+        d = _mm_max_epi16(d, _mm_subs_epi16(zero, d));
+
+        ok = _mm_and_si128(
+            _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *) (e->hi + i)),
+                            vlo),
+            _mm_cmplt_epi16(_mm_loadu_si128((const __m128i *) (e->lo + i)),
+                            vhi));
+        ok = _mm_and_si128(ok, _mm_cmplt_epi16(d, bestdist));
+
+        bestdist = _mm_or_si128(_mm_and_si128(ok, d),
+                                _mm_andnot_si128(ok, bestdist));
+        bestpos = _mm_or_si128(_mm_and_si128(ok, p),
+                               _mm_andnot_si128(ok, bestpos));
+    }
+
+    _mm_storeu_si128((__m128i *) dists, bestdist);
+    _mm_storeu_si128((__m128i *) poss, bestpos);
+
+    /* Pick the closest lane. On a tie, the lowest position wins. */
+    for (j = 0; j < 8; j ++)
+    {
+        if (INT16_MAX == dists[j])
+        {
+            /* Nothing found in this lane. */
+            continue;
+        }
+
+        if (dists[j] < *best || (dists[j] == *best && poss[j] < *found))
+        {
+            *best = dists[j];
+            *found = poss[j];
+        }
+    }
+
+    scanscalar(e, i, end, pos, lo, hi, best, found);
+}
+#endif /* __SSE2__ */
+
+void snapclear(struct snapindex *idx)
+{
+    idx->len = 0;
+}
+
+int snapadd(struct snapindex *idx, int16_t x, int16_t y, uint16_t width,
+            uint16_t height)
+{
+    struct edge *added;
+    int16_t *pos;
+    int16_t *lo;
+    int16_t *hi;
+    unsigned size;
+    int i;
+
+    if (idx->len == idx->size)
+    {
+        size = 0 == idx->size ? 16 : idx->size * 2;
+
+        for (i = 0; i < SNAP_EDGES; i ++)
+        {
+            added = realloc(idx->added[i], size * sizeof (struct edge));
+            if (NULL == added)
+            {
+                return -1;
+            }
+            idx->added[i] = added;
+
+            pos = realloc(idx->edges[i].pos, size * sizeof (int16_t));
+            if (NULL == pos)
+            {
+                return -1;
+            }
+            idx->edges[i].pos = pos;
+
+            lo = realloc(idx->edges[i].lo, size * sizeof (int16_t));
+            if (NULL == lo)
+            {
+                return -1;
+            }
+            idx->edges[i].lo = lo;
+
+            hi = realloc(idx->edges[i].hi, size * sizeof (int16_t));
+            if (NULL == hi)
+            {
+                return -1;
+            }
+            idx->edges[i].hi = hi;
+        }
+
+        idx->size = size;
+    }
+
+    idx->added[SNAP_LEFT][idx->len].pos = x;
+    idx->added[SNAP_LEFT][idx->len].lo = y;
+    idx->added[SNAP_LEFT][idx->len].hi = y + height;
+
+    idx->added[SNAP_RIGHT][idx->len].pos = x + width;
+    idx->added[SNAP_RIGHT][idx->len].lo = y;
+    idx->added[SNAP_RIGHT][idx->len].hi = y + height;
+
+    idx->added[SNAP_TOP][idx->len].pos = y;
+    idx->added[SNAP_TOP][idx->len].lo = x;
+    idx->added[SNAP_TOP][idx->len].hi = x + width;
+
+    idx->added[SNAP_BOTTOM][idx->len].pos = y + height;
+    idx->added[SNAP_BOTTOM][idx->len].lo = x;
+    idx->added[SNAP_BOTTOM][idx->len].hi = x + width;
+
+    idx->len ++;
+
+    return 0;
+}
+
+void snapsort(struct snapindex *idx)
+{
+    struct edge *added;
+    struct edges *edges;
+    unsigned j;
+    int i;
+
+    for (i = 0; i < SNAP_EDGES; i ++)
+    {
+        added = idx->added[i];
+        edges = &idx->edges[i];
+
+        if (0 == idx->len)
+        {
+            continue;
+        }
+
+        qsort(added, idx->len, sizeof (struct edge), edgecmp);
+
+        for (j = 0; j < idx->len; j ++)
+        {
+            edges->pos[j] = added[j].pos;
+            edges->lo[j] = added[j].lo;
+            edges->hi[j] = added[j].hi;
+        }
+    }
+}
+
+bool snapfind(const struct snapindex *idx, int kind, int pos, int lo, int hi,
+              int margin, int16_t *found)
+{
+    const struct edges *edges = &idx->edges[kind];
+    unsigned first;
+    unsigned end;
+    int best = INT_MAX;
+
+    if (0 == idx->len)
+    {
+        return false;
+    }
+
+    /* Only look at edges less than margin away. */
+    first = lowerbound(edges->pos, idx->len, pos - margin + 1);
+    end = lowerbound(edges->pos, idx->len, pos + margin);
+
+    snapscan(edges, first, end, pos, lo, hi, &best, found);
+
+    return best < margin;
+}
+
+void snapfree(struct snapindex *idx)
+{
+    int i;
+
+    for (i = 0; i < SNAP_EDGES; i ++)
+    {
+        free(idx->added[i]);
+        free(idx->edges[i].pos);
+        free(idx->edges[i].lo);
+        free(idx->edges[i].hi);
+
+        idx->added[i] = NULL;
+        idx->edges[i].pos = NULL;
+        idx->edges[i].lo = NULL;
+        idx->edges[i].hi = NULL;
+    }
+
+    idx->len = 0;
+    idx->size = 0;
+}
+
+#ifdef BENCH
+
+/*
+ * Compare ways of finding the right edge to snap a window's left edge
+ * to: the loop over all windows snapwindow() used to do, the scalar
+ * and SSE2 kernels over all edges, and the sorted index.
+ *
+ * cc -std=c99 -O2 -DBENCH snap.c -o snapbench
+ */
+
+#include <time.h>
+
+#define QUERIES 200000
+#define MARGIN 16
+
+/* The parts of struct client snapwindow() used to look at. */
+struct win
+{
+    void *id;
+    int16_t x;
+    int16_t y;
+    uint16_t width;
+    uint16_t height;
+    char rest[64];
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+    static const unsigned counts[] = { 1, 4, 16, 64, 256, 1024, 4096 };
+    struct snapindex idx = { { NULL }, { { NULL, NULL, NULL } }, 0, 0 };
+    struct win *wins;
+    struct edges all;
+    int16_t *qx;
+    int16_t *qy;
+    unsigned c;
+    unsigned i;
+    unsigned j;
+    unsigned n;
+    int16_t found = 0;
+    int best;
+    double start;
+    double loopns;
+    double scalarns;
+    double simdns;
+    double indexns;
+    volatile long sink = 0;
+
+    qx = malloc(QUERIES * sizeof (int16_t));
+    qy = malloc(QUERIES * sizeof (int16_t));
+    if (NULL == qx || NULL == qy)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    srand(4711);
+
+    for (i = 0; i < QUERIES; i ++)
+    {
+        qx[i] = rand() % 3840;
+        qy[i] = rand() % 2160;
+    }
+
+    printf("%8s %10s %10s %10s %10s\n", "windows", "loop ns", "scalar ns",
+           "sse2 ns", "index ns");
+
+    for (c = 0; c < sizeof counts / sizeof counts[0]; c ++)
+    {
+        n = counts[c];
+
+        if (NULL == (wins = malloc(n * sizeof (struct win))))
+        {
+            perror("malloc");
+            exit(1);
+        }
+
+        snapclear(&idx);
+
+        for (i = 0; i < n; i ++)
+        {
+            wins[i].x = rand() % 3600;
+            wins[i].y = rand() % 2000;
+            wins[i].width = 100 + rand() % 800;
+            wins[i].height = 100 + rand() % 600;
+
+            if (-1 == snapadd(&idx, wins[i].x, wins[i].y, wins[i].width,
+                              wins[i].height))
+            {
+                perror("snapadd");
+                exit(1);
+            }
+        }
+
+        snapsort(&idx);
+        all = idx.edges[SNAP_RIGHT];
+
+        start = now();
+        for (i = 0; i < QUERIES; i ++)
+        {
+            int16_t x = qx[i];
+
+            for (j = 0; j < n; j ++)
+            {
+                if (abs((wins[j].x + wins[j].width) - qx[i]) < MARGIN
+                    && qy[i] + 200 > wins[j].y
+                    && qy[i] < wins[j].y + wins[j].height)
+                {
+                    x = wins[j].x + wins[j].width;
+                }
+            }
+            sink += x;
+        }
+        loopns = (now() - start) / QUERIES;
+
+        start = now();
+        for (i = 0; i < QUERIES; i ++)
+        {
+            best = INT_MAX;
+            scanscalar(&all, 0, n, qx[i], qy[i], qy[i] + 200, &best, &found);
+            sink += found;
+        }
+        scalarns = (now() - start) / QUERIES;
+
+#ifdef __SSE2__
+        start = now();
+        for (i = 0; i < QUERIES; i ++)
+        {
+            best = INT_MAX;
+            scansse2(&all, 0, n, qx[i], qy[i], qy[i] + 200, &best, &found);
+            sink += found;
+        }
+        simdns = (now() - start) / QUERIES;
+#else
+        simdns = 0;
+#endif
+
+        start = now();
+        for (i = 0; i < QUERIES; i ++)
+        {
+            sink += snapfind(&idx, SNAP_RIGHT, qx[i], qy[i], qy[i] + 200,
+                             MARGIN, &found);
+        }
+        indexns = (now() - start) / QUERIES;
+
+        printf("%8u %10.1f %10.1f %10.1f %10.1f\n", n, loopns, scalarns,
+               simdns, indexns);
+
+        free(wins);
+    }
+
+    snapfree(&idx);
+    free(qx);
+    free(qy);
+
+    return 0;
+}
+
+#endif /* BENCH */
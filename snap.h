@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Index of window edges to snap to, sorted by position so we can
+ * find the edges close to a point without looking at every window.
+ *
+ * Build it with snapclear(), snapadd() for every window and
+ * snapsort(). Then look things up with snapfind().
+ *
+ * A zeroed struct snapindex is a valid, empty index.
+ */
+
+/* Kinds of edges. */
+#define SNAP_LEFT 0
+#define SNAP_RIGHT 1
+#define SNAP_TOP 2
+#define SNAP_BOTTOM 3
+#define SNAP_EDGES 4
+
+/*
+ * An edge. pos is its X coordinate for left and right edges, Y for
+ * top and bottom. It runs from lo to hi along the other axis.
+ */
+struct edge
+{
+    int16_t pos;
+    int16_t lo;
+    int16_t hi;
+};
+
+/*
+ * All edges of one kind, sorted by pos. Kept as separate arrays so
+ * they can be searched several at a time.
+ */
+struct edges
+{
+    int16_t *pos;
+    int16_t *lo;
+    int16_t *hi;
+};
+
+struct snapindex
+{
+    struct edge *added[SNAP_EDGES]; /* Edges as added, before sorting. */
+    struct edges edges[SNAP_EDGES]; /* Sorted edges. */
+    unsigned len;               /* Number of windows in index. */
+    unsigned size;              /* Room for this many. */
+};
+
+/* Make the index empty. */
+void snapclear(struct snapindex *idx);
+
+/*
+ * Add the edges of a window at x,y with size width x height.
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int snapadd(struct snapindex *idx, int16_t x, int16_t y, uint16_t width,
+            uint16_t height);
+
+/* Sort the index after adding windows. */
+void snapsort(struct snapindex *idx);
+
+/*
+ * Find the edge of kind kind closest to pos, but less than margin
+ * away, that overlaps the open range lo to hi along the other axis.
+ *
+ * Returns true and the position of the edge in found if there is
+ * one.
+ */
+bool snapfind(const struct snapindex *idx, int kind, int pos, int lo, int hi,
+              int margin, int16_t *found);
+
+/* Free all memory used by the index and make it empty. */
+void snapfree(struct snapindex *idx);